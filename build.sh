@@ -6,4 +6,8 @@ if [[ $OS = *"Windows"* ]]; then
   LIBS="$LIBS -largp"
 fi
 
-gcc -Wall -O3 -D_GNU_SOURCE -o decodez80 src/main.c src/em_z80.c  $LIBS
+gcc -Wall -O3 -D_GNU_SOURCE -o decodez80 src/main.c src/em_z80.c src/memmap.c src/stats.c src/profile.c src/callgraph.c src/busstats.c src/intstats.c src/stackstats.c src/coverage.c src/memimage.c src/symbols.c src/cfg.c src/metrics.c src/trace.c src/filter.c src/warnings.c src/failreport.c  $LIBS
+
+gcc -Wall -O3 -D_GNU_SOURCE -o covmerge src/covmerge.c src/coverage.c  $LIBS
+
+gcc -Wall -O3 -D_GNU_SOURCE -o memmerge src/memmerge.c src/memimage.c  $LIBS
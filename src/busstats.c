@@ -0,0 +1,244 @@
+//
+// Bus timing analytics
+//
+// The wait states of each bus cycle are attributed to the address it
+// accessed: memory cycles to a region of the address space, and IO cycles
+// to the port (the low eight bits of the IO address). Each region and port
+// accumulates counts of fetch, read and write cycles and a histogram of the
+// wait states per cycle, from which percentiles are derived.
+//
+// Regions are given as START-END[=NAME], e.g. 0x4000-0x7fff=screen. If none
+// are given the address space is divided into sixteen 4K regions. Addresses
+// outside every region are accumulated as "other", and cycles whose address
+// could not be emulated as "unknown".
+//
+// The analytics are written at exit, as CSV if the filename ends in .csv,
+// and otherwise as JSON.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <inttypes.h>
+#include "busstats.h"
+
+#define MAX_REGIONS 64
+
+#define MAX_REGION_NAME 32
+
+// The last histogram bucket counts this many wait states or more
+#define NUM_WAIT_BUCKETS 32
+
+#define NUM_PORTS 256
+
+typedef struct {
+   char name[MAX_REGION_NAME];
+   int start;
+   int end;
+} RegionType;
+
+typedef struct {
+   uint64_t cycles[3];
+   uint64_t wait_cycles;
+   int max_wait;
+   uint64_t hist[NUM_WAIT_BUCKETS];
+} BusEntryType;
+
+static RegionType regions[MAX_REGIONS];
+static int num_regions = 0;
+
+// The region containing each address (num_regions if there is none)
+static uint8_t region_of[0x10000];
+
+// Regions, followed by "other" and "unknown"
+static BusEntryType region_stats[MAX_REGIONS + 2];
+
+// Ports, followed by "unknown"
+static BusEntryType port_stats[NUM_PORTS + 1];
+
+static BusEntryType intack_stats;
+
+int busstats_add_region(const char *spec) {
+   char *end;
+   if (num_regions == MAX_REGIONS) {
+      return 1;
+   }
+   RegionType *region = &regions[num_regions];
+   region->start = strtol(spec, &end, 0);
+   if (end == spec || *end != '-') {
+      return 1;
+   }
+   spec = end + 1;
+   region->end = strtol(spec, &end, 0);
+   if (end == spec || (*end && *end != '=') ||
+       region->start < 0 || region->end > 0xffff || region->start > region->end) {
+      return 1;
+   }
+   // The name is quoted in the output
+   if (*end == '=' && strchr(end + 1, '"')) {
+      return 1;
+   }
+   if (*end == '=') {
+      snprintf(region->name, sizeof(region->name), "%s", end + 1);
+   } else {
+      snprintf(region->name, sizeof(region->name), "%04X-%04X", region->start, region->end);
+   }
+   num_regions++;
+   return 0;
+}
+
+void busstats_init() {
+   if (!num_regions) {
+      char spec[16];
+      for (int i = 0; i < 0x10000; i += 0x1000) {
+         sprintf(spec, "%d-%d", i, i + 0xfff);
+         busstats_add_region(spec);
+      }
+   }
+   // Where regions overlap, the first one given wins
+   memset(region_of, num_regions, sizeof(region_of));
+   for (int i = num_regions - 1; i >= 0; i--) {
+      memset(region_of + regions[i].start, i, regions[i].end - regions[i].start + 1);
+   }
+}
+
+void busstats_cycle(int space, int addr, int kind, int wait_cycles) {
+   BusEntryType *entry;
+   if (space == BUS_SPACE_MEMORY) {
+      entry = &region_stats[addr >= 0 ? region_of[addr] : num_regions + 1];
+   } else if (space == BUS_SPACE_IO) {
+      entry = &port_stats[addr >= 0 ? addr & 0xff : NUM_PORTS];
+   } else {
+      entry = &intack_stats;
+   }
+   entry->cycles[kind]++;
+   entry->wait_cycles += wait_cycles;
+   if (wait_cycles > entry->max_wait) {
+      entry->max_wait = wait_cycles;
+   }
+   entry->hist[wait_cycles < NUM_WAIT_BUCKETS ? wait_cycles : NUM_WAIT_BUCKETS - 1]++;
+}
+
+// ===================================================================
+// Output
+// ===================================================================
+
+typedef struct {
+   uint64_t cycles;
+   double mean;
+   int p50;
+   int p90;
+   int p99;
+   int num_buckets;
+} SummaryType;
+
+static int percentile(BusEntryType *entry, uint64_t total, int percent) {
+   // The smallest wait with at least percent% of cycles at or below it
+   uint64_t threshold = (total * percent + 99) / 100;
+   uint64_t sum = 0;
+   for (int i = 0; i < NUM_WAIT_BUCKETS; i++) {
+      sum += entry->hist[i];
+      if (sum >= threshold) {
+         return i;
+      }
+   }
+   return NUM_WAIT_BUCKETS - 1;
+}
+
+static void summarise(BusEntryType *entry, SummaryType *summary) {
+   summary->cycles = entry->cycles[BUS_FETCH] + entry->cycles[BUS_READ] + entry->cycles[BUS_WRITE];
+   summary->mean   = summary->cycles ? (double) entry->wait_cycles / (double) summary->cycles : 0.0;
+   summary->p50    = percentile(entry, summary->cycles, 50);
+   summary->p90    = percentile(entry, summary->cycles, 90);
+   summary->p99    = percentile(entry, summary->cycles, 99);
+   summary->num_buckets = NUM_WAIT_BUCKETS;
+   while (summary->num_buckets > 1 && !entry->hist[summary->num_buckets - 1]) {
+      summary->num_buckets--;
+   }
+}
+
+static void write_csv_entry(FILE *stream, const char *space, const char *name, int start, int end, BusEntryType *entry) {
+   SummaryType summary;
+   summarise(entry, &summary);
+   if (!summary.cycles) {
+      return;
+   }
+   fprintf(stream, "%s,\"%s\",", space, name);
+   if (start >= 0) {
+      fprintf(stream, "%04X,%04X,", start, end);
+   } else {
+      fprintf(stream, ",,");
+   }
+   fprintf(stream, "%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%.3f,%d,%d,%d,%d,",
+           summary.cycles, entry->cycles[BUS_FETCH], entry->cycles[BUS_READ], entry->cycles[BUS_WRITE],
+           entry->wait_cycles, summary.mean, summary.p50, summary.p90, summary.p99, entry->max_wait);
+   for (int i = 0; i < summary.num_buckets; i++) {
+      fprintf(stream, "%s%" PRIu64, i ? " " : "", entry->hist[i]);
+   }
+   fprintf(stream, "\n");
+}
+
+static int write_json_entry(FILE *stream, int first, const char *key, const char *name, int start, int end, BusEntryType *entry) {
+   SummaryType summary;
+   summarise(entry, &summary);
+   if (!summary.cycles) {
+      return first;
+   }
+   fprintf(stream, "%s\n    {\"%s\": \"%s\", ", first ? "" : ",", key, name);
+   if (start >= 0) {
+      fprintf(stream, "\"start\": \"%04X\", \"end\": \"%04X\", ", start, end);
+   }
+   fprintf(stream, "\"cycles\": %" PRIu64 ", \"fetch\": %" PRIu64 ", \"read\": %" PRIu64 ", \"write\": %" PRIu64 ", ",
+           summary.cycles, entry->cycles[BUS_FETCH], entry->cycles[BUS_READ], entry->cycles[BUS_WRITE]);
+   fprintf(stream, "\"wait_cycles\": %" PRIu64 ", \"mean_wait\": %.3f, \"p50\": %d, \"p90\": %d, \"p99\": %d, \"max_wait\": %d, \"histogram\": [",
+           entry->wait_cycles, summary.mean, summary.p50, summary.p90, summary.p99, entry->max_wait);
+   for (int i = 0; i < summary.num_buckets; i++) {
+      fprintf(stream, "%s%" PRIu64, i ? ", " : "", entry->hist[i]);
+   }
+   fprintf(stream, "]}");
+   return 0;
+}
+
+int busstats_write(const char *filename) {
+   char name[16];
+   FILE *stream = fopen(filename, "w");
+   if (!stream) {
+      perror("failed to open bus statistics file");
+      return 1;
+   }
+   int len = strlen(filename);
+   if (len >= 4 && !strcasecmp(filename + len - 4, ".csv")) {
+      fprintf(stream, "space,name,start,end,cycles,fetch,read,write,wait_cycles,mean_wait,p50,p90,p99,max_wait,histogram\n");
+      for (int i = 0; i < num_regions; i++) {
+         write_csv_entry(stream, "memory", regions[i].name, regions[i].start, regions[i].end, &region_stats[i]);
+      }
+      write_csv_entry(stream, "memory", "other", -1, -1, &region_stats[num_regions]);
+      write_csv_entry(stream, "memory", "unknown", -1, -1, &region_stats[num_regions + 1]);
+      for (int i = 0; i < NUM_PORTS; i++) {
+         sprintf(name, "%02X", i);
+         write_csv_entry(stream, "io", name, -1, -1, &port_stats[i]);
+      }
+      write_csv_entry(stream, "io", "unknown", -1, -1, &port_stats[NUM_PORTS]);
+      write_csv_entry(stream, "intack", "intack", -1, -1, &intack_stats);
+   } else {
+      fprintf(stream, "{\n  \"memory\": [");
+      int first = 1;
+      for (int i = 0; i < num_regions; i++) {
+         first = write_json_entry(stream, first, "region", regions[i].name, regions[i].start, regions[i].end, &region_stats[i]);
+      }
+      first = write_json_entry(stream, first, "region", "other", -1, -1, &region_stats[num_regions]);
+      first = write_json_entry(stream, first, "region", "unknown", -1, -1, &region_stats[num_regions + 1]);
+      fprintf(stream, "\n  ],\n  \"io\": [");
+      first = 1;
+      for (int i = 0; i < NUM_PORTS; i++) {
+         sprintf(name, "%02X", i);
+         first = write_json_entry(stream, first, "port", name, -1, -1, &port_stats[i]);
+      }
+      first = write_json_entry(stream, first, "port", "unknown", -1, -1, &port_stats[NUM_PORTS]);
+      fprintf(stream, "\n  ],\n  \"intack\": [");
+      write_json_entry(stream, 1, "name", "intack", -1, -1, &intack_stats);
+      fprintf(stream, "\n  ]\n}\n");
+   }
+   fclose(stream);
+   return 0;
+}
@@ -0,0 +1,19 @@
+#ifndef _INCLUDE_BUSSTATS_H
+#define _INCLUDE_BUSSTATS_H
+
+// The address space of a bus cycle
+#define BUS_SPACE_MEMORY 0
+#define BUS_SPACE_IO     1
+#define BUS_SPACE_INTACK 2
+
+// The kind of a bus cycle
+#define BUS_FETCH 0
+#define BUS_READ  1
+#define BUS_WRITE 2
+
+int  busstats_add_region(const char *spec);
+void busstats_init();
+void busstats_cycle(int space, int addr, int kind, int wait_cycles);
+int  busstats_write(const char *filename);
+
+#endif
@@ -0,0 +1,262 @@
+//
+// Call graph reconstruction
+//
+// A shadow call stack follows the CALLs, RSTs and interrupts of the target
+// program, building a calling context tree in which each node accumulates
+// the T-states spent in that function when reached by that path. INT and
+// NMI handlers are separate frames, named after their vector.
+//
+// A frame ends when the stack slot holding its return address is popped,
+// i.e. when SP rises above the SP just after the call. This copes with
+// functions that discard their return address, LD SP,HL and EX (SP),HL,
+// and keeps the shadow stack no deeper than the real one. When SP is not
+// known, a RET instead ends the frames up to one with a matching return
+// address.
+//
+// The tree is written at exit in callgrind format (for KCachegrind), or as
+// folded stacks (for flame graphs).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include "callgraph.h"
+
+#define MAX_CALL_DEPTH 1024
+
+typedef struct {
+   int kind;
+   int fn;
+   int parent;
+   int first_child;
+   int next_sibling;
+   uint64_t calls;
+   uint64_t self_cycles;
+   uint64_t self_wait;
+   uint64_t incl_cycles;
+   uint64_t incl_wait;
+} CallNode;
+
+static CallNode *nodes = NULL;
+static int num_nodes = 0;
+static int max_nodes = 0;
+
+static ShadowFrameType frames[MAX_CALL_DEPTH];
+static int frame_nodes[MAX_CALL_DEPTH];
+static int depth = 0;
+
+// Calls that were not followed because the shadow stack was full
+static uint64_t overflows = 0;
+
+static int new_node(int kind, int fn, int parent) {
+   if (num_nodes == max_nodes) {
+      max_nodes = max_nodes ? max_nodes * 2 : 1024;
+      nodes = realloc(nodes, max_nodes * sizeof(CallNode));
+      if (!nodes) {
+         perror("failed to allocate call graph");
+         exit(2);
+      }
+   }
+   CallNode *node = &nodes[num_nodes];
+   node->kind         = kind;
+   node->fn           = fn;
+   node->parent       = parent;
+   node->first_child  = -1;
+   node->next_sibling = -1;
+   node->calls        = 0;
+   node->self_cycles  = 0;
+   node->self_wait    = 0;
+   if (parent >= 0) {
+      node->next_sibling = nodes[parent].first_child;
+      nodes[parent].first_child = num_nodes;
+   }
+   return num_nodes++;
+}
+
+static int find_child(int parent, int kind, int fn) {
+   for (int i = nodes[parent].first_child; i >= 0; i = nodes[i].next_sibling) {
+      if (nodes[i].kind == kind && nodes[i].fn == fn) {
+         return i;
+      }
+   }
+   return new_node(kind, fn, parent);
+}
+
+static int current_node() {
+   return depth ? frame_nodes[depth - 1] : 0;
+}
+
+static void push_frame(int kind, int fn, int return_addr, int sp) {
+   if (depth == MAX_CALL_DEPTH) {
+      overflows++;
+      return;
+   }
+   int node = find_child(current_node(), kind, fn);
+   nodes[node].calls++;
+   frame_nodes[depth]        = node;
+   frames[depth].sp          = sp;
+   frames[depth].return_addr = return_addr;
+   depth++;
+}
+
+// ===================================================================
+// Shadow call stack
+// ===================================================================
+
+// Returns the depth of a shadow stack once the frames ended by an
+// instruction (which left SP at sp) have been removed
+int shadow_stack_depth(const ShadowFrameType *frames, int depth, int kind, int target, int sp) {
+   if (kind == CG_RET && (sp < 0 || (depth > 0 && frames[depth - 1].sp < 0))) {
+      for (int i = depth - 1; i >= 0; i--) {
+         if (frames[i].return_addr == target) {
+            depth = i;
+            break;
+         }
+      }
+   }
+   // End the frames whose return address is no longer on the stack
+   if (sp >= 0) {
+      int key = STACK_KEY(sp);
+      while (depth > 0 && frames[depth - 1].sp >= 0 && STACK_KEY(frames[depth - 1].sp) < key) {
+         depth--;
+      }
+   }
+   return depth;
+}
+
+// ===================================================================
+// Call graph
+// ===================================================================
+
+void callgraph_instruction(int kind, int target, int return_addr, int sp, int instr_cycles, int wait_cycles) {
+   if (!num_nodes) {
+      new_node(CG_ROOT, -1, -1);
+   }
+   // An interrupt acknowledge is charged to the handler
+   if (kind == CG_INT || kind == CG_NMI) {
+      push_frame(kind, target, return_addr, sp);
+   }
+   CallNode *node = &nodes[current_node()];
+   node->self_cycles += instr_cycles;
+   node->self_wait   += wait_cycles;
+   if (kind == CG_CALL) {
+      push_frame(kind, target, return_addr, sp);
+   }
+   depth = shadow_stack_depth(frames, depth, kind, target, sp);
+}
+
+// ===================================================================
+// Output
+// ===================================================================
+
+static char *node_name(CallNode *node, char *buffer) {
+   const char *prefix;
+   switch (node->kind) {
+   case CG_ROOT:
+      return "root";
+   case CG_INT:
+      prefix = "int";
+      break;
+   case CG_NMI:
+      prefix = "nmi";
+      break;
+   default:
+      prefix = "sub";
+      break;
+   }
+   if (node->fn >= 0) {
+      sprintf(buffer, "%s_%04X", prefix, node->fn);
+   } else {
+      sprintf(buffer, "%s_????", prefix);
+   }
+   return buffer;
+}
+
+// Children are always created after their parent
+static void compute_inclusive() {
+   for (int i = 0; i < num_nodes; i++) {
+      nodes[i].incl_cycles = nodes[i].self_cycles;
+      nodes[i].incl_wait   = nodes[i].self_wait;
+   }
+   for (int i = num_nodes - 1; i > 0; i--) {
+      nodes[nodes[i].parent].incl_cycles += nodes[i].incl_cycles;
+      nodes[nodes[i].parent].incl_wait   += nodes[i].incl_wait;
+   }
+}
+
+static void report_overflows() {
+   static int reported = 0;
+   if (overflows && !reported) {
+      fprintf(stderr, "call graph: %" PRIu64 " calls beyond a depth of %d were not followed\n", overflows, MAX_CALL_DEPTH);
+      reported = 1;
+   }
+}
+
+static int node_addr(CallNode *node) {
+   return node->fn >= 0 ? node->fn : 0;
+}
+
+int callgraph_write_callgrind(const char *filename) {
+   char name[16];
+   FILE *stream = fopen(filename, "w");
+   if (!stream) {
+      perror("failed to open callgrind file");
+      return 1;
+   }
+   if (!num_nodes) {
+      new_node(CG_ROOT, -1, -1);
+   }
+   compute_inclusive();
+   fprintf(stream, "# callgrind format\n");
+   fprintf(stream, "version: 1\n");
+   fprintf(stream, "creator: decodez80\n");
+   fprintf(stream, "positions: instr\n");
+   fprintf(stream, "events: Cycles Waits\n");
+   fprintf(stream, "summary: %" PRIu64 " %" PRIu64 "\n", nodes[0].incl_cycles, nodes[0].incl_wait);
+   for (int i = 0; i < num_nodes; i++) {
+      CallNode *node = &nodes[i];
+      int addr = node_addr(node);
+      fprintf(stream, "\nfn=%s\n", node_name(node, name));
+      fprintf(stream, "0x%04X %" PRIu64 " %" PRIu64 "\n", addr, node->self_cycles, node->self_wait);
+      for (int j = node->first_child; j >= 0; j = nodes[j].next_sibling) {
+         CallNode *child = &nodes[j];
+         fprintf(stream, "cfn=%s\n", node_name(child, name));
+         fprintf(stream, "calls=%" PRIu64 " 0x%04X\n", child->calls, node_addr(child));
+         fprintf(stream, "0x%04X %" PRIu64 " %" PRIu64 "\n", addr, child->incl_cycles, child->incl_wait);
+      }
+   }
+   report_overflows();
+   fclose(stream);
+   return 0;
+}
+
+static void write_folded_node(FILE *stream, int i, char *path, int len) {
+   char name[16];
+   CallNode *node = &nodes[i];
+   if (len) {
+      path[len++] = ';';
+   }
+   len += sprintf(path + len, "%s", node_name(node, name));
+   if (node->self_cycles) {
+      fprintf(stream, "%s %" PRIu64 "\n", path, node->self_cycles);
+   }
+   for (int j = node->first_child; j >= 0; j = nodes[j].next_sibling) {
+      write_folded_node(stream, j, path, len);
+   }
+}
+
+int callgraph_write_folded(const char *filename) {
+   FILE *stream = fopen(filename, "w");
+   if (!stream) {
+      perror("failed to open folded stacks file");
+      return 1;
+   }
+   // Each frame name is at most 8 characters plus a separator
+   char *path = malloc((MAX_CALL_DEPTH + 1) * 10);
+   if (path && num_nodes) {
+      write_folded_node(stream, 0, path, 0);
+   }
+   free(path);
+   report_overflows();
+   fclose(stream);
+   return 0;
+}
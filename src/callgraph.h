@@ -0,0 +1,29 @@
+#ifndef _INCLUDE_CALLGRAPH_H
+#define _INCLUDE_CALLGRAPH_H
+
+// The effect of an instruction on the call graph
+#define CG_ROOT -1
+#define CG_OTHER 0
+#define CG_CALL  1
+#define CG_RET   2
+#define CG_INT   3
+#define CG_NMI   4
+
+// Orders stack pointers by depth (lower is deeper), allowing for a stack
+// that starts at 0000
+#define STACK_KEY(sp) ((((sp) - 1) & 0xffff) + 1)
+
+// A frame of a shadow call stack: the SP just after the return address was
+// pushed (-1 if unknown), and the return address
+typedef struct {
+   int sp;
+   int return_addr;
+} ShadowFrameType;
+
+int  shadow_stack_depth(const ShadowFrameType *frames, int depth, int kind, int target, int sp);
+
+void callgraph_instruction(int kind, int target, int return_addr, int sp, int instr_cycles, int wait_cycles);
+int  callgraph_write_callgrind(const char *filename);
+int  callgraph_write_folded(const char *filename);
+
+#endif
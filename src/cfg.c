@@ -0,0 +1,350 @@
+//
+// Dynamic control flow graph
+//
+// Each executed instruction is recorded by PC (with its execution count,
+// T-states and bytes), together with every control transfer seen between
+// instructions: taken and not taken branches, calls, returns and
+// interrupts. The basic blocks are only formed when the graph is written,
+// so a block that is later entered part way through is simply split.
+//
+// A block starts at the first instruction, at the target of any branch,
+// call or interrupt, and after any branch, call or return instruction
+// (whether taken or not). Returns don't start a block, so that returning
+// from an interrupt handler to the middle of a block doesn't split it.
+//
+// Edge counts are the number of times the transfer happened, and edge
+// T-states are those of the instruction that made it (or of the
+// acknowledge, for an interrupt). A block whose instruction bytes changed
+// during the capture is flagged as self-modifying.
+//
+// The output is DOT if the filename ends in .dot, and otherwise JSON.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <inttypes.h>
+#include "callgraph.h"
+#include "cfg.h"
+
+#define EDGE_FALLTHROUGH 0
+#define EDGE_BRANCH      1
+#define EDGE_CALL        2
+#define EDGE_RETURN      3
+#define EDGE_INTERRUPT   4
+
+static const char *edge_names[] = { "fallthrough", "branch", "call", "return", "interrupt" };
+
+#define FLAG_BRANCH 1
+#define FLAG_SMC    2
+#define FLAG_LEADER 4
+
+typedef struct {
+   uint64_t count;
+   uint64_t cycles;
+   uint64_t bytes;
+   int len;
+   int flags;
+} CfgInstrType;
+
+typedef struct {
+   uint64_t key;   // kind, from and to
+   uint64_t count;
+   uint64_t cycles;
+} CfgEdgeType;
+
+static CfgInstrType instrs[0x10000];
+
+// Edges are kept in an open addressed hash table, which grows as needed
+static CfgEdgeType *edges = NULL;
+static int edges_size = 0;
+static int num_edges = 0;
+
+// The previous instruction, from which the next transfer is made
+static int prev_pc = -1;
+static int prev_len;
+static int prev_kind;
+static int prev_cycles;
+static int started = 0;
+
+#define EDGE_KEY(kind, from, to) (((uint64_t) (kind) << 32) | ((uint64_t) (from) << 16) | (to))
+
+static int edge_hash(uint64_t key, int size) {
+   return (int) ((key * 0x9E3779B97F4A7C15ull) >> 40) & (size - 1);
+}
+
+static CfgEdgeType *find_edge(uint64_t key) {
+   if ((num_edges + 1) * 4 > edges_size * 3) {
+      // Grow the table, rehashing the existing edges
+      int size = edges_size ? edges_size * 2 : 4096;
+      CfgEdgeType *table = calloc(size, sizeof(CfgEdgeType));
+      if (!table) {
+         return NULL;
+      }
+      for (int i = 0; i < edges_size; i++) {
+         if (edges[i].count) {
+            int j = edge_hash(edges[i].key, size);
+            while (table[j].count) {
+               j = (j + 1) & (size - 1);
+            }
+            table[j] = edges[i];
+         }
+      }
+      free(edges);
+      edges = table;
+      edges_size = size;
+   }
+   int i = edge_hash(key, edges_size);
+   while (edges[i].count && edges[i].key != key) {
+      i = (i + 1) & (edges_size - 1);
+   }
+   if (!edges[i].count) {
+      edges[i].key = key;
+      num_edges++;
+   }
+   return &edges[i];
+}
+
+static void add_edge(int kind, int from, int to, int cycles) {
+   CfgEdgeType *edge = find_edge(EDGE_KEY(kind, from, to));
+   if (edge) {
+      edge->count++;
+      edge->cycles += cycles;
+   }
+   if (kind != EDGE_RETURN) {
+      instrs[to].flags |= FLAG_LEADER;
+   }
+}
+
+// Records an instruction at pc, or an interrupt (kind CG_INT or CG_NMI) to
+// the handler at target. A branch is any instruction that can transfer
+// control (a jump, call, return or RST), whether or not it did so.
+void cfg_instruction(int kind, int target, int pc, int branch, const int *bytes, int len, int instr_cycles) {
+   if (kind == CG_INT || kind == CG_NMI) {
+      if (prev_pc >= 0 && target >= 0) {
+         add_edge(EDGE_INTERRUPT, prev_pc, target, instr_cycles);
+      }
+      prev_pc = -1;
+      return;
+   }
+   if (pc < 0) {
+      prev_pc = -1;
+      return;
+   }
+   if (len == 0) {
+      // The NOPs executed while halted are counted with the HALT
+      if (prev_pc >= 0) {
+         instrs[prev_pc].cycles += instr_cycles;
+      }
+      return;
+   }
+   if (!started) {
+      instrs[pc].flags |= FLAG_LEADER;
+      started = 1;
+   }
+   if (prev_pc >= 0) {
+      int sequential = pc == ((prev_pc + prev_len) & 0xffff);
+      if (instrs[prev_pc].flags & FLAG_BRANCH) {
+         int edge_kind = EDGE_BRANCH;
+         if (prev_kind == CG_CALL) {
+            edge_kind = EDGE_CALL;
+         } else if (prev_kind == CG_RET) {
+            edge_kind = EDGE_RETURN;
+         } else if (sequential) {
+            edge_kind = EDGE_FALLTHROUGH;
+         }
+         add_edge(edge_kind, prev_pc, pc, prev_cycles);
+      } else if (!sequential) {
+         add_edge(EDGE_BRANCH, prev_pc, pc, prev_cycles);
+      }
+   }
+   uint64_t packed = 0;
+   for (int i = 0; i < len; i++) {
+      packed = (packed << 8) | bytes[i];
+   }
+   CfgInstrType *instr = &instrs[pc];
+   if (instr->count && (instr->len != len || instr->bytes != packed)) {
+      instr->flags |= FLAG_SMC;
+   }
+   instr->count++;
+   instr->cycles += instr_cycles;
+   instr->bytes = packed;
+   instr->len = len;
+   if (branch) {
+      instr->flags |= FLAG_BRANCH;
+   }
+   prev_pc     = pc;
+   prev_len    = len;
+   prev_kind   = kind;
+   prev_cycles = instr_cycles;
+}
+
+// ===================================================================
+// Output
+// ===================================================================
+
+typedef struct {
+   int start;
+   int last;   // the PC of the last instruction
+   int num_instrs;
+   int num_bytes;
+   uint64_t count;
+   uint64_t cycles;
+   int smc;
+} CfgBlockType;
+
+typedef struct {
+   int from;
+   int to;
+   int kind;
+   uint64_t count;
+   uint64_t cycles;
+} CfgBlockEdgeType;
+
+static int compare_block_edges(const void *a, const void *b) {
+   const CfgBlockEdgeType *x = a;
+   const CfgBlockEdgeType *y = b;
+   if (x->from != y->from) {
+      return x->from - y->from;
+   } else if (x->to != y->to) {
+      return x->to - y->to;
+   }
+   return x->kind - y->kind;
+}
+
+int cfg_write(const char *filename) {
+   static int block_of[0x10000];
+   // The transfers other than interrupts from each instruction
+   static uint64_t out_count[0x10000];
+   static uint64_t out_cycles[0x10000];
+   FILE *stream = fopen(filename, "w");
+   if (!stream) {
+      perror("failed to open control flow graph file");
+      return 1;
+   }
+
+   // Form the basic blocks
+   CfgBlockType *blocks = malloc(0x10000 * sizeof(CfgBlockType));
+   CfgBlockEdgeType *block_edges = malloc((num_edges + 0x10000) * sizeof(CfgBlockEdgeType));
+   if (!blocks || !block_edges) {
+      perror("failed to allocate control flow graph");
+      fclose(stream);
+      return 1;
+   }
+   int num_blocks = 0;
+   CfgBlockType *block = NULL;
+   for (int pc = 0; pc < 0x10000; pc++) {
+      CfgInstrType *instr = &instrs[pc];
+      block_of[pc] = -1;
+      if (!instr->count) {
+         continue;
+      }
+      if (!block || pc != block->last + instrs[block->last].len ||
+          (instr->flags & FLAG_LEADER) || (instrs[block->last].flags & FLAG_BRANCH)) {
+         block = &blocks[num_blocks++];
+         block->start      = pc;
+         block->num_instrs = 0;
+         block->num_bytes  = 0;
+         block->count      = instr->count;
+         block->cycles     = 0;
+         block->smc        = 0;
+      }
+      block->last = pc;
+      block->num_instrs++;
+      block->num_bytes += instr->len;
+      block->cycles    += instr->cycles;
+      block->smc       |= (instr->flags & FLAG_SMC) != 0;
+      block_of[pc] = num_blocks - 1;
+   }
+
+   // Map the edges onto the blocks, and add the implied fall through edges
+   // from blocks that end without a branch
+   int n = 0;
+   for (int i = 0; i < edges_size; i++) {
+      CfgEdgeType *edge = &edges[i];
+      if (edge->count) {
+         int from = (edge->key >> 16) & 0xffff;
+         int to   = edge->key & 0xffff;
+         int kind = edge->key >> 32;
+         if (kind != EDGE_INTERRUPT) {
+            out_count[from]  += edge->count;
+            out_cycles[from] += edge->cycles;
+         }
+         if (block_of[from] >= 0 && block_of[to] >= 0) {
+            CfgBlockEdgeType *e = &block_edges[n++];
+            e->from   = block_of[from];
+            e->to     = block_of[to];
+            e->kind   = kind;
+            e->count  = edge->count;
+            e->cycles = edge->cycles;
+         }
+      }
+   }
+   for (int i = 0; i < num_blocks - 1; i++) {
+      int last = blocks[i].last;
+      CfgInstrType *instr = &instrs[last];
+      if (!(instr->flags & FLAG_BRANCH) && blocks[i + 1].start == last + instr->len) {
+         // Every execution not accounted for by another transfer
+         if (instr->count > out_count[last]) {
+            CfgBlockEdgeType *e = &block_edges[n++];
+            e->from   = i;
+            e->to     = i + 1;
+            e->kind   = EDGE_FALLTHROUGH;
+            e->count  = instr->count - out_count[last];
+            e->cycles = instr->cycles > out_cycles[last] ? instr->cycles - out_cycles[last] : 0;
+         }
+      }
+   }
+
+   // Merge the edges between the same blocks
+   qsort(block_edges, n, sizeof(CfgBlockEdgeType), compare_block_edges);
+   int num_block_edges = 0;
+   for (int i = 0; i < n; i++) {
+      if (num_block_edges && !compare_block_edges(&block_edges[num_block_edges - 1], &block_edges[i])) {
+         block_edges[num_block_edges - 1].count  += block_edges[i].count;
+         block_edges[num_block_edges - 1].cycles += block_edges[i].cycles;
+      } else {
+         block_edges[num_block_edges++] = block_edges[i];
+      }
+   }
+
+   int len = strlen(filename);
+   int dot = len >= 4 && !strcasecmp(filename + len - 4, ".dot");
+   if (dot) {
+      fprintf(stream, "digraph cfg {\n");
+      fprintf(stream, "  node [shape=box, fontname=\"monospace\"];\n");
+      for (int i = 0; i < num_blocks; i++) {
+         CfgBlockType *b = &blocks[i];
+         fprintf(stream, "  B%04X [label=\"%04X-%04X\\n%d instr\\n%" PRIu64 " x, %" PRIu64 " T\"%s];\n",
+                 b->start, b->start, b->last, b->num_instrs, b->count, b->cycles,
+                 b->smc ? ", style=filled, fillcolor=salmon" : "");
+      }
+      static const char *edge_styles[] = { "", ", style=bold", ", color=blue", ", color=blue, style=dashed", ", color=red, style=dotted" };
+      for (int i = 0; i < num_block_edges; i++) {
+         CfgBlockEdgeType *e = &block_edges[i];
+         fprintf(stream, "  B%04X -> B%04X [label=\"%" PRIu64 "\"%s];\n",
+                 blocks[e->from].start, blocks[e->to].start, e->count, edge_styles[e->kind]);
+      }
+      fprintf(stream, "}\n");
+   } else {
+      fprintf(stream, "{\n  \"blocks\": [");
+      for (int i = 0; i < num_blocks; i++) {
+         CfgBlockType *b = &blocks[i];
+         fprintf(stream, "%s\n    {\"start\": \"%04X\", \"last\": \"%04X\", \"instructions\": %d, \"bytes\": %d, "
+                 "\"count\": %" PRIu64 ", \"cycles\": %" PRIu64 ", \"self_modifying\": %s}",
+                 i ? "," : "", b->start, b->last, b->num_instrs, b->num_bytes, b->count, b->cycles,
+                 b->smc ? "true" : "false");
+      }
+      fprintf(stream, "\n  ],\n  \"edges\": [");
+      for (int i = 0; i < num_block_edges; i++) {
+         CfgBlockEdgeType *e = &block_edges[i];
+         fprintf(stream, "%s\n    {\"from\": \"%04X\", \"to\": \"%04X\", \"kind\": \"%s\", \"count\": %" PRIu64 ", \"cycles\": %" PRIu64 "}",
+                 i ? "," : "", blocks[e->from].start, blocks[e->to].start, edge_names[e->kind], e->count, e->cycles);
+      }
+      fprintf(stream, "\n  ]\n}\n");
+   }
+   free(blocks);
+   free(block_edges);
+   fclose(stream);
+   return 0;
+}
@@ -0,0 +1,7 @@
+#ifndef _INCLUDE_CFG_H
+#define _INCLUDE_CFG_H
+
+void cfg_instruction(int kind, int target, int pc, int branch, const int *bytes, int len, int instr_cycles);
+int  cfg_write(const char *filename);
+
+#endif
@@ -0,0 +1,130 @@
+//
+// Execution, read and write coverage
+//
+// The coverage file is an 8 byte header ("Z80COV01") followed by the
+// fetch, read and write bitmaps of the memory address space (8K bytes
+// each) and the read and write bitmaps of the IO ports (32 bytes each).
+// Bit n of a bitmap is bit (n & 7) of byte (n >> 3).
+//
+// Coverage files from many captures can be combined with covmerge.
+
+#include <stdio.h>
+#include <string.h>
+#include "coverage.h"
+
+static const char magic[8] = { 'Z', '8', '0', 'C', 'O', 'V', '0', '1' };
+
+int coverage_load(const char *filename, CoverageType *coverage) {
+   char header[sizeof(magic)];
+   FILE *stream = fopen(filename, "rb");
+   if (!stream) {
+      perror(filename);
+      return 1;
+   }
+   int ok = fread(header, sizeof(header), 1, stream) == 1 &&
+      !memcmp(header, magic, sizeof(magic)) &&
+      fread(coverage, sizeof(CoverageType), 1, stream) == 1;
+   fclose(stream);
+   if (!ok) {
+      fprintf(stderr, "%s: not a coverage file\n", filename);
+      return 1;
+   }
+   return 0;
+}
+
+int coverage_save(const char *filename, const CoverageType *coverage) {
+   FILE *stream = fopen(filename, "wb");
+   if (!stream) {
+      perror("failed to open coverage file");
+      return 1;
+   }
+   int ok = fwrite(magic, sizeof(magic), 1, stream) == 1 &&
+      fwrite(coverage, sizeof(CoverageType), 1, stream) == 1;
+   if (fclose(stream) || !ok) {
+      perror("failed to write coverage file");
+      return 1;
+   }
+   return 0;
+}
+
+void coverage_merge(CoverageType *coverage, const CoverageType *other) {
+   // The bitmaps are contiguous, so are combined in a single (vectorised) loop
+   uint8_t *dst = (uint8_t *) coverage;
+   const uint8_t *src = (const uint8_t *) other;
+   for (int i = 0; i < sizeof(CoverageType); i++) {
+      dst[i] |= src[i];
+   }
+}
+
+// ===================================================================
+// Report
+// ===================================================================
+
+static const char *class_names[8] = {
+   "untouched",
+   "code",
+   "read only data",
+   "code, read as data",
+   "write only data",
+   "code, written",
+   "read/write data",
+   "code, read/written as data"
+};
+
+static int address_class(const CoverageType *coverage, int addr) {
+   return COVERAGE_GET(coverage->fetch, addr) |
+      (COVERAGE_GET(coverage->read, addr) << 1) |
+      (COVERAGE_GET(coverage->write, addr) << 2);
+}
+
+static void report_ports(FILE *stream, const char *title, const uint8_t *map) {
+   int count = 0;
+   fprintf(stream, "%s:", title);
+   for (int port = 0; port < 256; port++) {
+      if (COVERAGE_GET(map, port)) {
+         fprintf(stream, " %02X", port);
+         count++;
+      }
+   }
+   fprintf(stream, "%s\n", count ? "" : " none");
+}
+
+void coverage_report(FILE *stream, const CoverageType *coverage) {
+   int totals[8] = { 0 };
+   int start = 0;
+   int start_class = address_class(coverage, 0);
+   fprintf(stream, "Memory:\n\n");
+   for (int addr = 0; addr <= 0x10000; addr++) {
+      int class = addr < 0x10000 ? address_class(coverage, addr) : -1;
+      if (class != start_class) {
+         fprintf(stream, "%04X-%04X %c%c%c %s\n", start, addr - 1,
+                 (start_class & 1) ? 'F' : '-',
+                 (start_class & 2) ? 'R' : '-',
+                 (start_class & 4) ? 'W' : '-',
+                 class_names[start_class]);
+         start = addr;
+         start_class = class;
+      }
+      if (class >= 0) {
+         totals[class]++;
+      }
+   }
+   fprintf(stream, "\nTotals:\n\n");
+   for (int i = 0; i < 8; i++) {
+      fprintf(stream, "%5d %s\n", totals[i], class_names[i]);
+   }
+   fprintf(stream, "\n");
+   report_ports(stream, "IO ports read", coverage->io_read);
+   report_ports(stream, "IO ports written", coverage->io_write);
+}
+
+int coverage_write_report(const char *filename, const CoverageType *coverage) {
+   FILE *stream = fopen(filename, "w");
+   if (!stream) {
+      perror("failed to open coverage report file");
+      return 1;
+   }
+   coverage_report(stream, coverage);
+   fclose(stream);
+   return 0;
+}
@@ -0,0 +1,25 @@
+#ifndef _INCLUDE_COVERAGE_H
+#define _INCLUDE_COVERAGE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Bitmaps of the memory addresses and IO ports (low eight bits) accessed
+typedef struct {
+   uint8_t fetch[0x10000 / 8];
+   uint8_t read[0x10000 / 8];
+   uint8_t write[0x10000 / 8];
+   uint8_t io_read[256 / 8];
+   uint8_t io_write[256 / 8];
+} CoverageType;
+
+#define COVERAGE_SET(map, addr) ((map)[(addr) >> 3] |= 1 << ((addr) & 7))
+#define COVERAGE_GET(map, addr) (((map)[(addr) >> 3] >> ((addr) & 7)) & 1)
+
+int  coverage_load(const char *filename, CoverageType *coverage);
+int  coverage_save(const char *filename, const CoverageType *coverage);
+void coverage_merge(CoverageType *coverage, const CoverageType *other);
+void coverage_report(FILE *stream, const CoverageType *coverage);
+int  coverage_write_report(const char *filename, const CoverageType *coverage);
+
+#endif
@@ -0,0 +1,92 @@
+//
+// Merges the coverage files written by decodez80 --coverage
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <argp.h>
+#include "coverage.h"
+
+const char *argp_program_version = "covmerge 0.1";
+
+const char *argp_program_bug_address = "<dave@hoglet.com>";
+
+static char doc[] = "\n\
+Merges the coverage files written by decodez80 --coverage.\n\
+\n\
+";
+
+static char args_doc[] = "FILENAME...";
+
+static struct argp_option options[] = {
+   { "output",       'o',   "FILE",                   0, "Write the merged coverage to FILE"},
+   { "report",       'r',   "FILE",                   0, "Write a report of the merged coverage to FILE (- for stdout)"},
+   { 0 }
+};
+
+struct arguments {
+   char *output;
+   char *report;
+   char **files;
+   int num_files;
+} arguments;
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state) {
+   struct arguments *arguments = state->input;
+
+   switch (key) {
+   case 'o':
+      arguments->output = arg;
+      break;
+   case 'r':
+      arguments->report = arg;
+      break;
+   case ARGP_KEY_ARGS:
+      arguments->files = state->argv + state->next;
+      arguments->num_files = state->argc - state->next;
+      break;
+   case ARGP_KEY_NO_ARGS:
+      argp_usage(state);
+      break;
+   default:
+      return ARGP_ERR_UNKNOWN;
+   }
+   return 0;
+}
+
+static struct argp argp = { options, parse_opt, args_doc, doc, 0, 0, 0 };
+
+static CoverageType merged;
+
+static CoverageType coverage;
+
+int main(int argc, char *argv[]) {
+   arguments.output    = NULL;
+   arguments.report    = NULL;
+   arguments.files     = NULL;
+   arguments.num_files = 0;
+   argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+   for (int i = 0; i < arguments.num_files; i++) {
+      if (coverage_load(arguments.files[i], &coverage)) {
+         return 2;
+      }
+      coverage_merge(&merged, &coverage);
+   }
+
+   if (arguments.output && coverage_save(arguments.output, &merged)) {
+      return 2;
+   }
+
+   if (arguments.report && strcmp(arguments.report, "-")) {
+      if (coverage_write_report(arguments.report, &merged)) {
+         return 2;
+      }
+   } else if (arguments.report || !arguments.output) {
+      // Report to stdout by default
+      coverage_report(stdout, &merged);
+   }
+
+   return 0;
+}
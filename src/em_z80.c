@@ -6,9 +6,11 @@
 
 #include <stdio.h>
 #include <string.h>
-#include <stdarg.h>
+#include <strings.h>
+#include <stdint.h>
 #include <inttypes.h>
 #include "em_z80.h"
+#include "memmap.h"
 
 #define UNDEFINED1 {0, 0, 0, 0, False, TYPE_0, "???", op_nop}
 
@@ -157,16 +159,13 @@ static int *reg_ptr[] = {
    &reg_iyl
 };
 
-#ifdef MEMORY_MODELLING
-static int memory[0x10000];
-#endif
+// Whether memory modelling is enabled (the shadow memory is in memmap.c)
+static int mem_model;
 
 // ===================================================================
 // Emulation output
 // ===================================================================
 
-static char buffer[1024];
-
 static const char default_state[] = "A=?? F=???????? BC=???? DE=???? HL=???? IX=???? IY=???? SP=????";
 static const char full_state[]    = "A=?? F=???????? BC=???? DE=???? HL=???? IX=???? IY=???? SP=???? : WZ=???? IR=???? IFF=?? IM=?";
 
@@ -187,6 +186,63 @@ static const char full_state[]    = "A=?? F=???????? BC=???? DE=???? HL=???? IX=
 #define OFFSET_IFF 86
 #define OFFSET_IM  92
 
+// The rendered state line persists between instructions, and only the
+// fields whose value has changed since it was last rendered are rewritten
+
+typedef enum {
+   FIELD_FLAG,
+   FIELD_HEX1,
+   FIELD_HEX2,
+   FIELD_HEX4
+} FieldType;
+
+typedef struct {
+   int *value;
+   int offset;
+   FieldType type;
+   char flag;
+   int rendered;
+} StateField;
+
+static StateField state_fields[] = {
+   // Fields shown in the default state
+   { &reg_a,      OFFSET_A,      FIELD_HEX2, 0   },
+   { &flag_s,     OFFSET_F + 0,  FIELD_FLAG, 'S' },
+   { &flag_z,     OFFSET_F + 1,  FIELD_FLAG, 'Z' },
+   { &flag_f5,    OFFSET_F + 2,  FIELD_FLAG, 'Y' },
+   { &flag_h,     OFFSET_F + 3,  FIELD_FLAG, 'H' },
+   { &flag_f3,    OFFSET_F + 4,  FIELD_FLAG, 'X' },
+   { &flag_pv,    OFFSET_F + 5,  FIELD_FLAG, 'V' },
+   { &flag_n,     OFFSET_F + 6,  FIELD_FLAG, 'N' },
+   { &flag_c,     OFFSET_F + 7,  FIELD_FLAG, 'C' },
+   { &reg_b,      OFFSET_B,      FIELD_HEX2, 0   },
+   { &reg_c,      OFFSET_C,      FIELD_HEX2, 0   },
+   { &reg_d,      OFFSET_D,      FIELD_HEX2, 0   },
+   { &reg_e,      OFFSET_E,      FIELD_HEX2, 0   },
+   { &reg_h,      OFFSET_H,      FIELD_HEX2, 0   },
+   { &reg_l,      OFFSET_L,      FIELD_HEX2, 0   },
+   { &reg_ixh,    OFFSET_IX,     FIELD_HEX2, 0   },
+   { &reg_ixl,    OFFSET_IX + 2, FIELD_HEX2, 0   },
+   { &reg_iyh,    OFFSET_IY,     FIELD_HEX2, 0   },
+   { &reg_iyl,    OFFSET_IY + 2, FIELD_HEX2, 0   },
+   { &reg_sp,     OFFSET_SP,     FIELD_HEX4, 0   },
+   // Additional fields shown in the full state
+   { &reg_memptr, OFFSET_WZ,     FIELD_HEX4, 0   },
+   { &reg_i,      OFFSET_IR,     FIELD_HEX2, 0   },
+   { &reg_r,      OFFSET_IR + 2, FIELD_HEX2, 0   },
+   { &reg_iff1,   OFFSET_IFF,    FIELD_HEX1, 0   },
+   { &reg_iff2,   OFFSET_IFF + 1,FIELD_HEX1, 0   },
+   { &reg_im,     OFFSET_IM,     FIELD_HEX1, 0   }
+};
+
+#define NUM_DEFAULT_FIELDS 20
+#define NUM_FULL_FIELDS    (sizeof(state_fields) / sizeof(StateField))
+
+static char buffer[sizeof(full_state)];
+
+// The verbosity the buffer was last rendered for
+static int state_verbosity = -1;
+
 static void write_flag(char *buffer, int flag, int value) {
    *buffer = value ? flag : ' ';
 }
@@ -207,105 +263,124 @@ static void write_hex4(char *buffer, int value) {
    write_hex1(buffer++, (value >> 0) & 15);
 }
 
-char *z80_get_state(int verbosity) {
-   strcpy(buffer, verbosity > 1 ? full_state : default_state);
-   if (reg_a >= 0) {
-      write_hex2(buffer + OFFSET_A, reg_a);
-   }
-   if (flag_s >= 0) {
-      write_flag(buffer + OFFSET_F + 0, 'S', flag_s);
-   }
-   if (flag_z >= 0) {
-      write_flag(buffer + OFFSET_F + 1, 'Z', flag_z);
-   }
-   if (flag_f5 >= 0) {
-      write_flag(buffer + OFFSET_F + 2, 'Y', flag_f5);
-   }
-   if (flag_h >= 0) {
-      write_flag(buffer + OFFSET_F + 3, 'H', flag_h);
-   }
-   if (flag_f3 >= 0) {
-      write_flag(buffer + OFFSET_F + 4, 'X', flag_f3);
-   }
-   if (flag_pv >= 0) {
-      write_flag(buffer + OFFSET_F + 5, 'V', flag_pv);
-   }
-   if (flag_n >= 0) {
-      write_flag(buffer + OFFSET_F + 6, 'N', flag_n);
-   }
-   if (flag_c >= 0) {
-      write_flag(buffer + OFFSET_F + 7, 'C', flag_c);
-   }
-   if (reg_b >= 0) {
-      write_hex2(buffer + OFFSET_B, reg_b);
-   }
-   if (reg_c >= 0) {
-      write_hex2(buffer + OFFSET_C, reg_c);
-   }
-   if (reg_d >= 0) {
-      write_hex2(buffer + OFFSET_D, reg_d);
-   }
-   if (reg_e >= 0) {
-      write_hex2(buffer + OFFSET_E, reg_e);
-   }
-   if (reg_h >= 0) {
-      write_hex2(buffer + OFFSET_H, reg_h);
-   }
-   if (reg_l >= 0) {
-      write_hex2(buffer + OFFSET_L, reg_l);
-   }
-   if (reg_ixh >= 0) {
-      write_hex2(buffer + OFFSET_IX, reg_ixh);
-   }
-   if (reg_ixl >= 0) {
-      write_hex2(buffer + OFFSET_IX + 2, reg_ixl);
-   }
-   if (reg_iyh >= 0) {
-      write_hex2(buffer + OFFSET_IY, reg_iyh);
-   }
-   if (reg_iyl >= 0) {
-      write_hex2(buffer + OFFSET_IY + 2, reg_iyl);
+static void write_field(char *buffer, StateField *field, int value) {
+   // Unknown values are shown as ?
+   static const int width[] = { 1, 1, 2, 4 };
+   if (value < 0) {
+      memset(buffer, '?', width[field->type]);
+      return;
    }
-   if (reg_sp >= 0) {
-      write_hex4(buffer + OFFSET_SP, reg_sp);
+   switch (field->type) {
+   case FIELD_FLAG:
+      write_flag(buffer, field->flag, value);
+      break;
+   case FIELD_HEX1:
+      write_hex1(buffer, value);
+      break;
+   case FIELD_HEX2:
+      write_hex2(buffer, value);
+      break;
+   case FIELD_HEX4:
+      write_hex4(buffer, value);
+      break;
    }
-   if (verbosity > 1) {
-      if (reg_memptr >= 0) {
-         write_hex4(buffer + OFFSET_WZ, reg_memptr);
-      }
-      if (reg_i >= 0) {
-         write_hex2(buffer + OFFSET_IR, reg_i);
-      }
-      if (reg_r >= 0) {
-         write_hex2(buffer + OFFSET_IR + 2, reg_r);
-      }
-      if (reg_iff1 >= 0) {
-         write_hex1(buffer + OFFSET_IFF, reg_iff1);
-      }
-      if (reg_iff2 >= 0) {
-         write_hex1(buffer + OFFSET_IFF + 1, reg_iff2);
+}
+
+char *z80_get_state(int verbosity) {
+   int num_fields = verbosity > 1 ? NUM_FULL_FIELDS : NUM_DEFAULT_FIELDS;
+   if (verbosity != state_verbosity) {
+      // Start again from the template, where every field is unknown
+      strcpy(buffer, verbosity > 1 ? full_state : default_state);
+      for (int i = 0; i < num_fields; i++) {
+         state_fields[i].rendered = -1;
       }
-      if (reg_im >= 0) {
-         write_hex1(buffer + OFFSET_IM, reg_im);
+      state_verbosity = verbosity;
+   }
+   for (int i = 0; i < num_fields; i++) {
+      StateField *field = &state_fields[i];
+      int value = *field->value;
+      if (value != field->rendered) {
+         write_field(buffer + field->offset, field, value);
+         field->rendered = value;
       }
    }
    return buffer;
 }
 
+// Returns whether every register and flag in the default state is known
+int z80_state_known() {
+   for (int i = 0; i < NUM_DEFAULT_FIELDS; i++) {
+      if (*state_fields[i].value < 0) {
+         return 0;
+      }
+   }
+   return 1;
+}
+
 int z80_get_pc() {
    return reg_pc;
 }
 
+int z80_get_sp() {
+   return reg_sp;
+}
+
 int z80_get_im() {
    return reg_im;
 }
 
+// Registers that can be read by name, with register pairs split into their
+// high and low halves
+static const struct {
+   const char *name;
+   int *hi;
+   int *lo;
+} named_regs[] = {
+   { "a",  NULL,     &reg_a   },
+   { "b",  NULL,     &reg_b   },
+   { "c",  NULL,     &reg_c   },
+   { "d",  NULL,     &reg_d   },
+   { "e",  NULL,     &reg_e   },
+   { "h",  NULL,     &reg_h   },
+   { "l",  NULL,     &reg_l   },
+   { "i",  NULL,     &reg_i   },
+   { "r",  NULL,     &reg_r   },
+   { "bc", &reg_b,   &reg_c   },
+   { "de", &reg_d,   &reg_e   },
+   { "hl", &reg_h,   &reg_l   },
+   { "ix", &reg_ixh, &reg_ixl },
+   { "iy", &reg_iyh, &reg_iyl },
+   { "sp", NULL,     &reg_sp  },
+   { "wz", NULL,     &reg_memptr }
+};
+
+// Returns the index of the named register for z80_get_reg(), or -1
+int z80_reg_index(const char *name) {
+   for (int i = 0; i < sizeof(named_regs) / sizeof(named_regs[0]); i++) {
+      if (!strcasecmp(name, named_regs[i].name)) {
+         return i;
+      }
+   }
+   return -1;
+}
+
+// Returns the value of a register, or -1 if it is unknown
+int z80_get_reg(int index) {
+   int lo = *named_regs[index].lo;
+   if (!named_regs[index].hi) {
+      return lo;
+   }
+   int hi = *named_regs[index].hi;
+   return (hi < 0 || lo < 0) ? -1 : (hi << 8) | lo;
+}
+
 // ===================================================================
 // Emulation reset / interrupt
 // ===================================================================
 
-void z80_init(int cpu_type, int default_im) {
+void z80_init(int cpu_type, int default_im, int mem_model_enabled) {
    cpu = cpu_type;
+   mem_model = mem_model_enabled;
    // Defined on reset
    reg_pc      = -1;
    reg_sp      = -1;
@@ -353,11 +428,7 @@ void z80_init(int cpu_type, int default_im) {
    reg_memptr  = -1;
    reg_q       = -1;
    halted      =  0;
-#ifdef MEMORY_MODELLING
-   for (int i = 0; i <= 0xffff; i++) {
-      memory[i] = -1;
-   }
-#endif
+   memmap_init();
 }
 
 void z80_reset() {
@@ -408,6 +479,8 @@ void z80_reset() {
    reg_memptr  = -1;
    reg_q       = -1;
    halted      =  0;
+   // Banked memory returns to its reset mapping
+   memmap_reset();
 }
 
 void z80_increment_r() {
@@ -723,14 +796,27 @@ static inline void flags_not_updated() {
 // Memory Modelling
 // ===================================================================
 
-#ifdef MEMORY_MODELLING
-
 // TODO: allow memory bounds to be passed in as a command line parameter
 
+// Memory events are recorded in a structured form, and only formatted when printed
+
+typedef enum {
+   MEM_CONFLICT,
+   MEM_ILLEGAL_WRITE,
+   MEM_DEBUG_READ,
+   MEM_DEBUG_WRITE
+} MemEventType;
+
+typedef struct {
+   MemEventType type;
+   int addr;
+   int expected;
+   int actual;
+} MemEvent;
+
 #define NUM_MEM_LOG_ITEMS 16
-#define MEM_LOG_ITEM_SIZE 256
 
-static char mem_log[NUM_MEM_LOG_ITEMS][MEM_LOG_ITEM_SIZE];
+static MemEvent mem_log[NUM_MEM_LOG_ITEMS];
 
 static int mem_log_item = 0;
 
@@ -739,55 +825,127 @@ void z80_clear_mem_log() {
 }
 
 void z80_dump_mem_log() {
-   if (!mem_log_item) {
-      return;
-   }
-   int first = 1;
    for (int i = 0; i < mem_log_item; i++) {
-      if (!first) {
+      MemEvent *event = &mem_log[i];
+      if (i > 0) {
          printf("; ");
       }
-      printf("%s", mem_log[i]);
-      first = 0;
+      if (i == NUM_MEM_LOG_ITEMS - 1) {
+         printf("memory log overflow!");
+         break;
+      }
+      switch (event->type) {
+      case MEM_CONFLICT:
+         printf("memory modelling failed at %04x: expected %02x, actual %02x", event->addr, event->expected, event->actual);
+         break;
+      case MEM_ILLEGAL_WRITE:
+         printf("memory modelling failed at %04x: illegal write of %02x", event->addr, event->actual);
+         break;
+      case MEM_DEBUG_READ:
+         printf("RD %04x=%02x", event->addr, event->actual);
+         break;
+      case MEM_DEBUG_WRITE:
+         printf("WR %04x=%02x", event->addr, event->actual);
+         break;
+      }
    }
 }
 
-static void printm(const char* format, ...) {
-   if (mem_log_item < NUM_MEM_LOG_ITEMS - 1) {
-      va_list args;
-      va_start(args, format);
-      vsprintf(mem_log[mem_log_item++], format, args);
-      va_end(args);
-   } else if (mem_log_item == NUM_MEM_LOG_ITEMS - 1) {
-      sprintf(mem_log[mem_log_item++], "memory log overflow!");
+static void log_mem_event(MemEventType type, int addr, int expected, int actual) {
+   // The last slot is reserved to indicate the log overflowed
+   if (mem_log_item < NUM_MEM_LOG_ITEMS) {
+      MemEvent *event = &mem_log[mem_log_item++];
+      event->type     = type;
+      event->addr     = addr;
+      event->expected = expected;
+      event->actual   = actual;
    }
 }
 
-static void memory_read(int data, int ea) {
+// ===================================================================
+// Bus access log
+// ===================================================================
+
+// The addresses of the memory and IO accesses of the current instruction,
+// in the order they were emulated, so bus cycles can be attributed to them
+
+#define NUM_BUS_LOG_ITEMS 16
+
+static int bus_log_enabled = 0;
+
+static BusAccessType bus_log[NUM_BUS_LOG_ITEMS];
+
+static int bus_log_item = 0;
+
+void z80_set_bus_log(int enabled) {
+   bus_log_enabled = enabled;
+}
+
+void z80_clear_bus_log() {
+   bus_log_item = 0;
+}
+
+int z80_get_bus_log(const BusAccessType **log) {
+   *log = bus_log;
+   return bus_log_item;
+}
+
+static void log_bus_access(int type, int addr, int data) {
+   if (bus_log_item < NUM_BUS_LOG_ITEMS) {
+      bus_log[bus_log_item].type = type;
+      bus_log[bus_log_item].addr = addr;
+      bus_log[bus_log_item].data = data;
+      bus_log_item++;
+   }
+}
+
+// ===================================================================
+// Memory/IO access
+// ===================================================================
+
+// Checks a read against the shadow memory, without logging it as a bus access
+static void model_read(int data, int ea) {
+   if (!mem_model) {
+      return;
+   }
    if (ea >= 0 && ea <= 0xFFFF) {
 #ifdef MEMORY_DEBUG
-      printm("RD %04x=%02x", ea, data);
+      log_mem_event(MEM_DEBUG_READ, ea, -1, data);
       failflag |= FAIL_MEMORY;
 #endif
-      if (memory[ea] >=0 && memory[ea] != data) {
-         printm("memory modelling failed at %04x: expected %02x, actual %02x", ea, memory[ea], data);
+      int expected = memmap_read(ea);
+      if (expected >= 0 && expected != data) {
+         log_mem_event(MEM_CONFLICT, ea, expected, data);
          failflag |= FAIL_MEMORY;
       }
-      memory[ea] = data;
+      memmap_write(ea, data);
+   }
+}
+
+static void memory_read(int data, int ea) {
+   if (bus_log_enabled) {
+      log_bus_access(BUS_MEM_READ, ea, data);
    }
+   model_read(data, ea);
 }
 
 static void memory_write(int data, int ea) {
+   if (bus_log_enabled) {
+      log_bus_access(BUS_MEM_WRITE, ea, data);
+   }
+   if (!mem_model) {
+      return;
+   }
    if (ea >= 0 && ea <= 0xffff) {
       if (data < 0 || data > 255) {
-         printm("memory modelling failed at %04x: illegal write of %02x", ea, data);
+         log_mem_event(MEM_ILLEGAL_WRITE, ea, -1, data);
          failflag |= FAIL_MEMORY;
       } else {
 #ifdef MEMORY_DEBUG
-         printm("WR %04x=%02x", ea, data);
+         log_mem_event(MEM_DEBUG_WRITE, ea, -1, data);
          failflag |= FAIL_MEMORY;
 #endif
-         memory[ea] = data;
+         memmap_write(ea, data);
       }
    }
 }
@@ -799,6 +957,14 @@ static void memory_read16(int data, int ea) {
    }
 }
 
+// Instruction operands are modelled, but are not data accesses
+static void model_read_operand16(int data, int ea) {
+   if (ea >= 0 && ea < 0xFFFF) {
+      model_read(data & 0xff, ea);
+      model_read((data >> 8) & 0xff, (ea + 1) & 0xffff);
+   }
+}
+
 static void memory_write16(int data, int ea) {
    if (ea >= 0 && ea <= 0xffff) {
       memory_write(data & 0xff, ea);
@@ -820,23 +986,64 @@ static int get_hl_or_idxdisp() {
 }
 
 static void memory_read_hl_or_idxdisp(int data) {
-   memory_read(data, get_hl_or_idxdisp());
+   if (mem_model || bus_log_enabled) {
+      memory_read(data, get_hl_or_idxdisp());
+   }
 }
 
 static void memory_write_hl_or_idxdisp(int data) {
-   memory_write(data, get_hl_or_idxdisp());
+   if (mem_model || bus_log_enabled) {
+      memory_write(data, get_hl_or_idxdisp());
+   }
 }
 
-#else
+static void io_read(int data, int port) {
+   if (bus_log_enabled) {
+      log_bus_access(BUS_IO_READ, port, data);
+   }
+}
 
-#define memory_read(...)
-#define memory_write(...)
-#define memory_read16(...)
-#define memory_write16(...)
-#define memory_read_hl_or_idxdisp(...)
-#define memory_write_hl_or_idxdisp(...)
+static void io_write(int data, int port) {
+   if (bus_log_enabled) {
+      log_bus_access(BUS_IO_WRITE, port, data);
+   }
+   // IO writes may switch memory banks
+   if (mem_model) {
+      memmap_io_write(port, data);
+   }
+}
+
+static void memory_read_block(const uint8_t *data, int ea, int step, int n) {
+   if (!mem_model || ea < 0) {
+      return;
+   }
+#ifdef MEMORY_DEBUG
+   for (int i = 0; i < n; i++) {
+      memory_read(data[i], (ea + i * step) & 0xffff);
+   }
+#else
+   // Only locations that conflict need to go through memory_read()
+   int i = 0;
+   while ((i += memmap_compare((ea + i * step) & 0xffff, step, data + i, n - i)) < n) {
+      memory_read(data[i], (ea + i * step) & 0xffff);
+      i++;
+   }
+   memmap_write_block(ea, step, data, n);
+#endif
+}
 
+static void memory_write_block(const uint8_t *data, int ea, int step, int n) {
+   if (!mem_model || ea < 0) {
+      return;
+   }
+#ifdef MEMORY_DEBUG
+   for (int i = 0; i < n; i++) {
+      memory_write(data[i], (ea + i * step) & 0xffff);
+   }
+#else
+   memmap_write_block(ea, step, data, n);
 #endif
+}
 
 // ===================================================================
 // Emulated instructions - HALT/NOP/INT/NMI
@@ -846,20 +1053,20 @@ int z80_halted() {
    return halted;
 }
 
-static void op_halt(InstrType *instr) {
+static void op_halt(const InstrType *instr) {
    update_pc();
    halted = 1;
    // Update undocumented Q register
    flags_not_updated();
 }
 
-static void op_nop(InstrType *instr) {
+static void op_nop(const InstrType *instr) {
    update_pc();
    // Update undocumented Q register
    flags_not_updated();
 }
 
-static void op_interrupt_nmi(InstrType *instr) {
+static void op_interrupt_nmi(const InstrType *instr) {
    // Clear halted
    halted = 0;
    if (reg_pc >= 0 && reg_pc != arg_write) {
@@ -878,7 +1085,7 @@ static void op_interrupt_nmi(InstrType *instr) {
    flags_not_updated();
 }
 
-static void op_interrupt_int(InstrType *instr) {
+static void op_interrupt_int(const InstrType *instr) {
    // Clear halted
    halted = 0;
    // Disable interrupts
@@ -932,7 +1139,7 @@ static void op_interrupt_int(InstrType *instr) {
 // Emulated instructions - Push/Pop
 // ===================================================================
 
-static void op_push(InstrType *instr) {
+static void op_push(const InstrType *instr) {
    int reg_id = get_rr_id();
    if (reg_id == ID_RR_AF) {
       int tmp;
@@ -984,7 +1191,7 @@ static void op_push(InstrType *instr) {
    flags_not_updated();
 }
 
-static void op_pop(InstrType *instr) {
+static void op_pop(const InstrType *instr) {
    int reg_id = get_rr_id();
    write_reg_pair2(reg_id, arg_read);
    if (reg_sp >= 0) {
@@ -1056,7 +1263,7 @@ static int test_cc(int cc) {
    return taken;
 }
 
-static void op_call(InstrType *instr) {
+static void op_call(const InstrType *instr) {
    update_pc();
    // The stacked PC is the next instuction
    if (reg_pc >= 0 && reg_pc != arg_write) {
@@ -1073,7 +1280,7 @@ static void op_call(InstrType *instr) {
    flags_not_updated();
 }
 
-static void op_call_cond(InstrType *instr) {
+static void op_call_cond(const InstrType *instr) {
    int cc = (opcode >> 3) & 7;
    int taken = test_cc(cc);
    if (taken >= 0) {
@@ -1092,7 +1299,7 @@ static void op_call_cond(InstrType *instr) {
    flags_not_updated();
 }
 
-static void op_ret(InstrType *instr) {
+static void op_ret(const InstrType *instr) {
    if (reg_sp >= 0) {
       memory_read16(arg_read, reg_sp);
       reg_sp = (reg_sp + 2) & 0xffff;
@@ -1104,7 +1311,7 @@ static void op_ret(InstrType *instr) {
    flags_not_updated();
 }
 
-static void op_retn(InstrType *instr) {
+static void op_retn(const InstrType *instr) {
    op_ret(instr);
    reg_iff1 = reg_iff2;
    // Also used for reti, as there is no difference from an emulation perspective
@@ -1112,7 +1319,7 @@ static void op_retn(InstrType *instr) {
    flags_not_updated();
 }
 
-static void op_ret_cond(InstrType *instr) {
+static void op_ret_cond(const InstrType *instr) {
    int cc = (opcode >> 3) & 7;
    int taken = test_cc(cc);
    if (taken >= 0) {
@@ -1130,7 +1337,7 @@ static void op_ret_cond(InstrType *instr) {
    flags_not_updated();
 }
 
-static void op_jr(InstrType *instr) {
+static void op_jr(const InstrType *instr) {
    int cc = (opcode >> 3) & 7;
    int taken = cc < 4 ? 1 : test_cc(cc - 4);
    // TODO: could infer more state from number of cycles
@@ -1150,7 +1357,7 @@ static void op_jr(InstrType *instr) {
    flags_not_updated();
 }
 
-static void op_jp(InstrType *instr) {
+static void op_jp(const InstrType *instr) {
    reg_pc = arg_imm;
    // Update undocumented memptr register
    update_memptr(arg_imm);
@@ -1158,7 +1365,7 @@ static void op_jp(InstrType *instr) {
    flags_not_updated();
 }
 
-static void op_jp_hl(InstrType *instr) {
+static void op_jp_hl(const InstrType *instr) {
    int rr_id = get_hl_or_idx_id();
    reg_pc = read_reg_pair1(rr_id);
    // Note: undocumented memptr does not change in this case
@@ -1166,7 +1373,7 @@ static void op_jp_hl(InstrType *instr) {
    flags_not_updated();
 }
 
-static void op_jp_cond(InstrType *instr) {
+static void op_jp_cond(const InstrType *instr) {
    int cc = (opcode >> 3) & 7;
    int taken = test_cc(cc);
    // TODO: could infer more state from number of cycles
@@ -1185,7 +1392,7 @@ static void op_jp_cond(InstrType *instr) {
    flags_not_updated();
 }
 
-static void op_djnz(InstrType *instr) {
+static void op_djnz(const InstrType *instr) {
    int taken = -1;
    if (reg_b >= 0) {
       reg_b = (reg_b - 1) & 0xff;
@@ -1207,7 +1414,7 @@ static void op_djnz(InstrType *instr) {
    flags_not_updated();
 }
 
-static void op_rst(InstrType *instr) {
+static void op_rst(const InstrType *instr) {
    // The stacked PC is the next instuction
    update_pc();
    if (reg_pc >= 0 && reg_pc != arg_write) {
@@ -1228,7 +1435,7 @@ static void op_rst(InstrType *instr) {
 // Emulated instructions - ALU
 // ===================================================================
 
-static void op_alu(InstrType *instr) {
+static void op_alu(const InstrType *instr) {
    int type    = (opcode >> 6) & 3;
    int alu_op  = (opcode >> 3) & 7;
    int operand;
@@ -1357,12 +1564,12 @@ static void op_alu(InstrType *instr) {
       if (type == 2) {
          memory_read_hl_or_idxdisp(arg_read);
       } else if (type == 3 && reg_pc >= 0) {
-         memory_read(arg_imm, (reg_pc - 1) & 0xffff);
+         model_read(arg_imm, (reg_pc - 1) & 0xffff);
       }
    }
 }
 
-static void op_neg(InstrType *instr) {
+static void op_neg(const InstrType *instr) {
    int result;
    int cbits;
    if (reg_a >= 0) {
@@ -1382,7 +1589,7 @@ static void op_neg(InstrType *instr) {
    flags_updated();
 }
 
-static void op_adc_hl_rr(InstrType *instr) {
+static void op_adc_hl_rr(const InstrType *instr) {
    int reg_id = get_rr_id();
    // This only appears in the ED block, hence uses just hl as the destination
    int dst_id = ID_RR_HL;
@@ -1408,7 +1615,7 @@ static void op_adc_hl_rr(InstrType *instr) {
    flags_updated();
 }
 
-static void op_sbc_hl_rr(InstrType *instr) {
+static void op_sbc_hl_rr(const InstrType *instr) {
    int reg_id = get_rr_id();
    // This only appears in the ED block, hence uses just hl as the destination
    int dst_id = ID_RR_HL;
@@ -1435,7 +1642,7 @@ static void op_sbc_hl_rr(InstrType *instr) {
 }
 
 
-static void op_add_hl_rr(InstrType *instr) {
+static void op_add_hl_rr(const InstrType *instr) {
    int reg_id = get_rr_id();
    // This appears in the unprefixed and DD/FD blocks, so the destination can be hl or ix/iy
    int dst_id = get_hl_or_idx_id();
@@ -1462,7 +1669,7 @@ static void op_add_hl_rr(InstrType *instr) {
 }
 
 
-static void op_inc_r(InstrType *instr) {
+static void op_inc_r(const InstrType *instr) {
    int reg_id = get_r_id((opcode >> 3) & 7);
    int *reg = reg_ptr[reg_id];
    if (*reg >= 0) {
@@ -1493,7 +1700,7 @@ static void op_inc_r(InstrType *instr) {
    }
 }
 
-static void op_inc_rr(InstrType *instr) {
+static void op_inc_rr(const InstrType *instr) {
    int reg_id = get_rr_id();
    int val = read_reg_pair1(reg_id);
    if (val >= 0) {
@@ -1506,7 +1713,7 @@ static void op_inc_rr(InstrType *instr) {
    flags_not_updated();
 }
 
-static void op_inc_idx_disp(InstrType *instr) {
+static void op_inc_idx_disp(const InstrType *instr) {
    int result = (arg_read + 1) & 0xff;
    set_sign_zero(result);
    flag_h  = (result & 0x0f) == 0;
@@ -1525,7 +1732,7 @@ static void op_inc_idx_disp(InstrType *instr) {
    memory_write_hl_or_idxdisp(arg_write);
 }
 
-static void op_dec_r(InstrType *instr) {
+static void op_dec_r(const InstrType *instr) {
    int reg_id = get_r_id((opcode >> 3) & 7);
    int *reg = reg_ptr[reg_id];
    if (*reg >= 0) {
@@ -1556,7 +1763,7 @@ static void op_dec_r(InstrType *instr) {
    }
 }
 
-static void op_dec_rr(InstrType *instr) {
+static void op_dec_rr(const InstrType *instr) {
    int reg_id = get_rr_id();
    int val = read_reg_pair1(reg_id);
    if (val >= 0) {
@@ -1569,7 +1776,7 @@ static void op_dec_rr(InstrType *instr) {
    flags_not_updated();
 }
 
-static void op_dec_idx_disp(InstrType *instr) {
+static void op_dec_idx_disp(const InstrType *instr) {
    int result = (arg_read - 1) & 0xff;
    set_sign_zero(result);
    flag_h  = (result & 0x0f) == 0x0f;
@@ -1592,7 +1799,7 @@ static void op_dec_idx_disp(InstrType *instr) {
 // Emulated instructions - Miscellaneous
 // ===================================================================
 
-static void op_di(InstrType *instr) {
+static void op_di(const InstrType *instr) {
    reg_iff1 = 0;
    reg_iff2 = 0;
    update_pc();
@@ -1600,7 +1807,7 @@ static void op_di(InstrType *instr) {
    flags_not_updated();
 }
 
-static void op_ei(InstrType *instr) {
+static void op_ei(const InstrType *instr) {
    reg_iff1 = 1;
    reg_iff2 = 1;
    update_pc();
@@ -1608,7 +1815,7 @@ static void op_ei(InstrType *instr) {
    flags_not_updated();
 }
 
-static void op_im(InstrType *instr) {
+static void op_im(const InstrType *instr) {
    switch ((opcode >> 3) & 3) {
    case 2:
       reg_im = 1;
@@ -1625,7 +1832,7 @@ static void op_im(InstrType *instr) {
    flags_not_updated();
 }
 
-static void op_rrd(InstrType *instr) {
+static void op_rrd(const InstrType *instr) {
    if (reg_a >= 0) {
       reg_a = (reg_a & 0xf0) | (arg_read & 0x0f);
       set_sign_zero(reg_a);
@@ -1649,7 +1856,7 @@ static void op_rrd(InstrType *instr) {
    }
 }
 
-static void op_rld(InstrType *instr) {
+static void op_rld(const InstrType *instr) {
    if (reg_a >= 0) {
       reg_a = (reg_a & 0xf0) | ((arg_read >> 4) & 0x0f);
       set_sign_zero(reg_a);
@@ -1673,7 +1880,7 @@ static void op_rld(InstrType *instr) {
    }
 }
 
-static void op_misc_rotate(InstrType *instr) {
+static void op_misc_rotate(const InstrType *instr) {
    if (reg_a < 0) {
       set_flags_undefined();
    } else {
@@ -1726,7 +1933,7 @@ static void op_misc_rotate(InstrType *instr) {
    flags_updated();
 }
 
-static void op_misc_daa(InstrType *instr) {
+static void op_misc_daa(const InstrType *instr) {
    if (reg_a < 0 || flag_h < 0 || flag_c < 0 || flag_n < 0) {
       reg_a = -1;
       set_flags_undefined();
@@ -1770,7 +1977,7 @@ static void op_misc_daa(InstrType *instr) {
    flags_updated();
 }
 
-static void op_misc_cpl(InstrType *instr) {
+static void op_misc_cpl(const InstrType *instr) {
    if (reg_a >= 0) {
       reg_a ^= 0xff;
       flag_f5 = (reg_a >> 5) & 1;
@@ -1835,7 +2042,7 @@ static void scf_ccf_set_f5_f3_flags() {
    flag_f3 = new_flag_f3;
 }
 
-static void op_misc_scf(InstrType *instr) {
+static void op_misc_scf(const InstrType *instr) {
    flag_h = 0;
    flag_c = 1;
    flag_n = 0;
@@ -1845,7 +2052,7 @@ static void op_misc_scf(InstrType *instr) {
    flags_updated();
 }
 
-static void op_misc_ccf(InstrType *instr) {
+static void op_misc_ccf(const InstrType *instr) {
    flag_h = flag_c;
    if (flag_c >= 0) {
       flag_c = flag_c ^ 1;
@@ -1861,7 +2068,7 @@ static void op_misc_ccf(InstrType *instr) {
 // Emulated instructions - Exchange
 // ===================================================================
 
-static void op_ex_af(InstrType *instr) {
+static void op_ex_af(const InstrType *instr) {
    swap(&reg_a,   &alt_reg_a);
    swap(&flag_s,  &alt_flag_s);
    swap(&flag_z,  &alt_flag_z);
@@ -1876,7 +2083,7 @@ static void op_ex_af(InstrType *instr) {
    flags_not_updated();
 }
 
-static void op_exx(InstrType *instr) {
+static void op_exx(const InstrType *instr) {
    swap(&reg_b,   &alt_reg_b);
    swap(&reg_c,   &alt_reg_c);
    swap(&reg_d,   &alt_reg_d);
@@ -1888,7 +2095,7 @@ static void op_exx(InstrType *instr) {
    flags_not_updated();
 };
 
-static void op_ex_de_hl(InstrType *instr) {
+static void op_ex_de_hl(const InstrType *instr) {
    swap(&reg_d,   &reg_h);
    swap(&reg_e,   &reg_l);
    update_pc();
@@ -1896,7 +2103,7 @@ static void op_ex_de_hl(InstrType *instr) {
    flags_not_updated();
 }
 
-static void op_ex_tos_hl(InstrType *instr) {
+static void op_ex_tos_hl(const InstrType *instr) {
    // (SP) <=> register L; (SP + 1) <=> register H
    // register is HL, IDX or IDY
    int reg_id = get_hl_or_idx_id();
@@ -1920,7 +2127,7 @@ static void op_ex_tos_hl(InstrType *instr) {
 // Emulated instructions - Load
 // ===================================================================
 
-static void op_load_a_i(InstrType *instr) {
+static void op_load_a_i(const InstrType *instr) {
    reg_a = reg_i;
    set_sign_zero(reg_a);
    flag_h = 0;
@@ -1931,7 +2138,7 @@ static void op_load_a_i(InstrType *instr) {
    flags_not_updated();
 }
 
-static void op_load_a_r(InstrType *instr) {
+static void op_load_a_r(const InstrType *instr) {
    reg_a = reg_r;
    set_sign_zero(reg_a);
    flag_h = 0;
@@ -1942,21 +2149,21 @@ static void op_load_a_r(InstrType *instr) {
    flags_updated();
 }
 
-static void op_load_i_a(InstrType *instr) {
+static void op_load_i_a(const InstrType *instr) {
    reg_i = reg_a;
    update_pc();
    // Update undocumented Q register
    flags_not_updated();
 }
 
-static void op_load_r_a(InstrType *instr) {
+static void op_load_r_a(const InstrType *instr) {
    reg_r = reg_a;
    update_pc();
    // Update undocumented Q register
    flags_not_updated();
 }
 
-static void op_load_sp_hl(InstrType *instr) {
+static void op_load_sp_hl(const InstrType *instr) {
    int rr_id = get_hl_or_idx_id();
    reg_sp = read_reg_pair1(rr_id);
    update_pc();
@@ -1964,7 +2171,7 @@ static void op_load_sp_hl(InstrType *instr) {
    flags_not_updated();
 }
 
-static void op_load_reg8(InstrType *instr) {
+static void op_load_reg8(const InstrType *instr) {
    // LD r[y], r[z]
    int dst_id = (opcode >> 3) & 7;
    int src_id = opcode & 7;
@@ -1997,7 +2204,7 @@ static void op_load_reg8(InstrType *instr) {
    flags_not_updated();
 }
 
-static void op_load_idx_disp(InstrType *instr) {
+static void op_load_idx_disp(const InstrType *instr) {
    if (arg_imm != arg_write) {
       failflag |= FAIL_ERROR;
    }
@@ -2010,7 +2217,7 @@ static void op_load_idx_disp(InstrType *instr) {
    memory_write_hl_or_idxdisp(arg_write);
 }
 
-static void op_load_imm8(InstrType *instr) {
+static void op_load_imm8(const InstrType *instr) {
    // LD r[y], n
    int reg_id = get_r_id((opcode >> 3) & 7);
    int *reg = reg_ptr[reg_id];
@@ -2026,14 +2233,14 @@ static void op_load_imm8(InstrType *instr) {
    flags_not_updated();
    // Update memory
    if (reg_pc >= 0) {
-      memory_read(arg_imm, (reg_pc - 1) & 0xffff);
+      model_read(arg_imm, (reg_pc - 1) & 0xffff);
    }
    if (reg_id == ID_MEMORY) {
       memory_write_hl_or_idxdisp(arg_write);
    }
 }
 
-static void op_load_imm16(InstrType *instr) {
+static void op_load_imm16(const InstrType *instr) {
    int reg_id = get_rr_id();
    write_reg_pair1(reg_id, arg_imm);
    update_pc();
@@ -2041,11 +2248,11 @@ static void op_load_imm16(InstrType *instr) {
    flags_not_updated();
    // Update memory
    if (reg_pc >= 0) {
-      memory_read16(arg_imm, (reg_pc - 2) & 0xffff);
+      model_read_operand16(arg_imm, (reg_pc - 2) & 0xffff);
    }
 }
 
-static void op_load_a(InstrType *instr) {
+static void op_load_a(const InstrType *instr) {
    // EA = (BC) or (DE) or (nn)
    reg_a = arg_read;
    // Update undocumented memptr register
@@ -2061,7 +2268,7 @@ static void op_load_a(InstrType *instr) {
    }
 }
 
-static void op_store_a(InstrType *instr) {
+static void op_store_a(const InstrType *instr) {
    // EA = (BC) or (DE) or (nn)
    if (reg_a >= 0 && reg_a != arg_write) {
       failflag |= FAIL_ERROR;
@@ -2080,7 +2287,7 @@ static void op_store_a(InstrType *instr) {
    }
 }
 
-static void op_load_mem16(InstrType *instr) {
+static void op_load_mem16(const InstrType *instr) {
    int reg_id = get_rr_id();
    write_reg_pair1(reg_id, arg_read);
    // Update undocumented memptr register
@@ -2092,7 +2299,7 @@ static void op_load_mem16(InstrType *instr) {
    memory_read16(arg_read, arg_imm);
 }
 
-static void op_store_mem16(InstrType *instr) {
+static void op_store_mem16(const InstrType *instr) {
    int rr_id = get_rr_id();
    int rr = read_reg_pair1(rr_id);
    if (rr >= 0 && rr != arg_write) {
@@ -2112,7 +2319,7 @@ static void op_store_mem16(InstrType *instr) {
 // Emulated instructions - In/Out
 // ===================================================================
 
-static void op_in_a_nn(InstrType *instr) {
+static void op_in_a_nn(const InstrType *instr) {
    // Update undocumented memptr register
    // MEMPTR = (A_before_operation << 8) + port + 1
    if (reg_a >= 0) {
@@ -2120,13 +2327,15 @@ static void op_in_a_nn(InstrType *instr) {
    } else {
       update_memptr(-1);
    }
+   // A is output on the upper half of the address bus
+   io_read(arg_read, reg_a >= 0 ? (reg_a << 8) | arg_imm : -1);
    reg_a = arg_read;
    update_pc();
    // Update undocumented Q register
    flags_not_updated();
 }
 
-static void op_out_nn_a(InstrType *instr) {
+static void op_out_nn_a(const InstrType *instr) {
    // Update undocumented memptr register
    // MEMPTR_low = (port + 1) & #FF,  MEMPTR_hi = A
    update_memptr_inc_split(reg_a, arg_imm);
@@ -2137,11 +2346,14 @@ static void op_out_nn_a(InstrType *instr) {
    update_pc();
    // Update undocumented Q register
    flags_not_updated();
+   // Update memory mapping (A is output on the upper half of the address bus)
+   io_write(arg_write, (arg_write << 8) | arg_imm);
 }
 
-static void op_in_r_c(InstrType *instr) {
+static void op_in_r_c(const InstrType *instr) {
    int reg_id = (opcode >> 3) & 7;
    int result = arg_read;
+   io_read(arg_read, read_reg_pair1(ID_RR_BC));
    // reg_id 6 is used for no destination
    if (reg_id != 6) {
       int *reg = reg_ptr[reg_id];
@@ -2159,7 +2371,7 @@ static void op_in_r_c(InstrType *instr) {
    flags_updated();
 }
 
-static void op_out_c_r(InstrType *instr) {
+static void op_out_c_r(const InstrType *instr) {
    int reg_id = (opcode >> 3) & 7;
    if (reg_id == 6) {
       // reg_id 6 is used for OUT (C),0
@@ -2179,6 +2391,8 @@ static void op_out_c_r(InstrType *instr) {
    update_memptr_inc(bc);
    // Update undocumented Q register
    flags_not_updated();
+   // Update memory mapping
+   io_write(arg_write, bc);
 }
 
 // ===================================================================
@@ -2272,7 +2486,7 @@ static void block_decrement_b(int io_data, int reg_other) {
    }
 }
 
-static void op_ind_ini(InstrType *instr) {
+static void op_ind_ini(const InstrType *instr) {
    // INI   0xA2
    // IND   0xAA
    // INIR  0xB2
@@ -2282,6 +2496,8 @@ static void op_ind_ini(InstrType *instr) {
    if (arg_write != arg_read) {
       failflag |= FAIL_ERROR;
    }
+   // The port address uses B before it is decremented
+   io_read(arg_read, read_reg_pair1(ID_RR_BC));
    // Update memory
    memory_write(arg_write, read_reg_pair1(ID_RR_HL));
    if (dec_op) {
@@ -2315,7 +2531,7 @@ static void op_ind_ini(InstrType *instr) {
    flags_updated();
 }
 
-static void op_outd_outi(InstrType *instr) {
+static void op_outd_outi(const InstrType *instr) {
    // OUTI   0xA3
    // OUTD   0xAB
    // OITIR  0xB3
@@ -2337,6 +2553,8 @@ static void op_outd_outi(InstrType *instr) {
    block_decrement_b(arg_write, reg_other);
    // Update undocumented memptr register after B is decremented
    int bc = read_reg_pair1(ID_RR_BC);
+   // Update memory mapping (the port address uses B after it is decremented)
+   io_write(arg_write, bc);
    // TODO: Use cycles to infer termination
    if (!repeat_op || flag_z == 1)  {
       update_pc();
@@ -2359,7 +2577,7 @@ static void op_outd_outi(InstrType *instr) {
 // Emulated instructions - Block load
 // ===================================================================
 
-static void op_ldd_ldi(InstrType *instr) {
+static void op_ldd_ldi(const InstrType *instr) {
    // LDI   0xA0
    // LDD   0xA8
    // LDIR  0xB0
@@ -2418,7 +2636,7 @@ static void op_ldd_ldi(InstrType *instr) {
    flags_updated();
 }
 
-static void op_cpd_cpi(InstrType *instr) {
+static void op_cpd_cpi(const InstrType *instr) {
    // CDI   0xA1
    // CPD   0xA9
    // CPIR  0xB1
@@ -2480,11 +2698,129 @@ static void op_cpd_cpi(InstrType *instr) {
    flags_updated();
 }
 
+// ===================================================================
+// Emulated instructions - Block runs
+// ===================================================================
+
+// A run is a sequence of iterations of a repeating block instruction
+// (LDxR, CPxR, INxR or OTxR) at the same PC, all but the last of which
+// repeat. The length of the run is determined from the state at the
+// start, so all but the last iteration can be emulated in bulk.
+
+static int block_counter() {
+   // INxR and OTxR count using B, LDxR and CPxR count using BC
+   return (opcode & 0x02) ? reg_b : read_reg_pair1(ID_RR_BC);
+}
+
+static int block_offset(int value, int delta) {
+   return value >= 0 ? (value + delta) & 0xffff : -1;
+}
+
+static int block_differs(const uint8_t *rd, const uint8_t *wr, int n) {
+   int diff = 0;
+   for (int i = 0; i < n; i++) {
+      diff |= rd[i] ^ wr[i];
+   }
+   return diff != 0;
+}
+
+int z80_block_run_start() {
+   // LDIR 0xB0, CPIR 0xB1, INIR 0xB2, OTIR 0xB3 (and the decrementing forms, 0xB8-0xBB)
+   if (prefix != 0xed || (opcode & 0xf4) != 0xb0) {
+      return 0;
+   }
+   // The length of the run can only be determined if the counter is known,
+   // and for CPxR also the value being searched for
+   if (reg_pc < 0 || block_counter() < 0 || ((opcode & 3) == 1 && reg_a < 0)) {
+      return 0;
+   }
+   return 1;
+}
+
+int z80_block_run_ends(int iteration, int data) {
+   int mask = (opcode & 0x02) ? 0xff : 0xffff;
+   if (((block_counter() - iteration - 1) & mask) == 0) {
+      return 1;
+   }
+   // CPxR also stops when a match is found
+   return (opcode & 3) == 1 && data == reg_a;
+}
+
+void z80_emulate_block_run(const InstrType *instr, const uint8_t *rd, const uint8_t *wr, int n) {
+   // The number of iterations that repeat
+   int m    = n - 1;
+   int step = (opcode & 0x08) ? -1 : 1;
+   int hl   = read_reg_pair1(ID_RR_HL);
+   int de   = read_reg_pair1(ID_RR_DE);
+   if (m > 0) {
+      switch (opcode & 3) {
+      case 0:
+         // LDxR
+         if (block_differs(rd, wr, m)) {
+            failflag |= FAIL_ERROR;
+         }
+         if (mem_model && hl >= 0 && de >= 0) {
+            int d = (de - hl) & 0xffff;
+            if (d < m || 0x10000 - d < m) {
+               // The source and destination overlap (e.g. a fill), so the order matters
+               for (int i = 0; i < m; i++) {
+                  memory_read(rd[i], (hl + i * step) & 0xffff);
+                  memory_write(wr[i], (de + i * step) & 0xffff);
+               }
+            } else {
+               memory_read_block(rd, hl, step, m);
+               memory_write_block(wr, de, step, m);
+            }
+         }
+         write_reg_pair1(ID_RR_DE, block_offset(de, m * step));
+         write_reg_pair1(ID_RR_HL, block_offset(hl, m * step));
+         write_reg_pair1(ID_RR_BC, block_offset(read_reg_pair1(ID_RR_BC), -m));
+         break;
+      case 1:
+         // CPxR
+         memory_read_block(rd, hl, step, m);
+         write_reg_pair1(ID_RR_HL, block_offset(hl, m * step));
+         write_reg_pair1(ID_RR_BC, block_offset(read_reg_pair1(ID_RR_BC), -m));
+         break;
+      case 2:
+         // INxR
+         if (block_differs(rd, wr, m)) {
+            failflag |= FAIL_ERROR;
+         }
+         memory_write_block(wr, hl, step, m);
+         write_reg_pair1(ID_RR_HL, block_offset(hl, m * step));
+         reg_b = (reg_b - m) & 0xff;
+         break;
+      case 3:
+         // OTxR
+         if (block_differs(rd, wr, m)) {
+            failflag |= FAIL_ERROR;
+         }
+         // Each write may switch memory banks, so this is done in order
+         for (int i = 0; i < m; i++) {
+            if (hl >= 0) {
+               memory_read(rd[i], (hl + i * step) & 0xffff);
+            }
+            reg_b = (reg_b - 1) & 0xff;
+            io_write(wr[i], read_reg_pair1(ID_RR_BC));
+         }
+         write_reg_pair1(ID_RR_HL, block_offset(hl, m * step));
+         break;
+      }
+      // Each repeating iteration leaves MEMPTR pointing just past the instruction
+      update_memptr_inc(reg_pc);
+   }
+   // The final iteration, which sets the flags, is emulated normally
+   arg_read  = rd[m];
+   arg_write = wr[m];
+   instr->emulate(instr);
+}
+
 // ===================================================================
 // Emulated instructions - Bit
 // ===================================================================
 
-static void op_bit(InstrType *instr) {
+static void op_bit(const InstrType *instr) {
    int reg_id   = opcode & 7;
    int major_op = (opcode >> 6) & 3;
    int minor_op = (opcode >> 3) & 7;
@@ -2685,7 +3021,7 @@ static void op_bit(InstrType *instr) {
 //  the displacement relative to the start of the instruction.
 
 // Instructions without a prefix
-InstrType main_instructions[256] = {
+static const InstrType main_instructions[256] = {
    {0, 0, 0, 0, False, TYPE_0, "NOP",               op_nop          }, // 0x00
    {0, 2, 0, 0, False, TYPE_8, "LD BC,%04Xh",       op_load_imm16   }, // 0x01
    {0, 0, 0, 1, False, TYPE_0, "LD (BC),A",         op_store_a      }, // 0x02
@@ -2964,7 +3300,7 @@ InstrType main_instructions[256] = {
 };
 
 // Instructions with ED prefix
-InstrType extended_instructions[256] = {
+static const InstrType extended_instructions[256] = {
    UNDEFINED1,                                                         // 0x00
    UNDEFINED1,                                                         // 0x01
    UNDEFINED1,                                                         // 0x02
@@ -3239,7 +3575,7 @@ InstrType extended_instructions[256] = {
 };
 
 // Instructions with CB prefix
-InstrType bit_instructions[256] = {
+static const InstrType bit_instructions[256] = {
    {0, 0, 0, 0, False, TYPE_0, "RLC B",             op_bit          }, // 0x00
    {0, 0, 0, 0, False, TYPE_0, "RLC C",             op_bit          }, // 0x01
    {0, 0, 0, 0, False, TYPE_0, "RLC D",             op_bit          }, // 0x02
@@ -3514,7 +3850,7 @@ InstrType bit_instructions[256] = {
 };
 
 // Instructions with DD or FD prefix
-InstrType index_instructions[256] = {
+static const InstrType index_instructions[256] = {
    UNDEFINED2,                                                         // 0x00
    UNDEFINED2,                                                         // 0x01
    UNDEFINED2,                                                         // 0x02
@@ -3792,7 +4128,7 @@ InstrType index_instructions[256] = {
 // For these instructions, the displacement precedes the opcode byte.
 // This is handled as a special case in the code, and thus the entries
 // in this table specify 0 for the displacement length.
-InstrType index_bit_instructions[256] = {
+static const InstrType index_bit_instructions[256] = {
    {0, 0, 1, 1, False, TYPE_5, "RLC (%s%+d),B",     op_bit          }, // 0x00
    {0, 0, 1, 1, False, TYPE_5, "RLC (%s%+d),C",     op_bit          }, // 0x01
    {0, 0, 1, 1, False, TYPE_5, "RLC (%s%+d),D",     op_bit          }, // 0x02
@@ -4067,13 +4403,13 @@ InstrType index_bit_instructions[256] = {
 };
 
 
-InstrType z80_interrupt_int =
+const InstrType z80_interrupt_int =
 {0, 0, 0, -2, False, TYPE_0, "INT", op_interrupt_int };
 
-InstrType z80_interrupt_nmi =
+const InstrType z80_interrupt_nmi =
 {0, 0, 0, -2, False, TYPE_0, "NMI", op_interrupt_nmi };
 
-InstrType *table_by_prefix(int prefix) {
+const InstrType *table_by_prefix(int prefix) {
    switch (prefix) {
    case 0:
       return main_instructions;
@@ -4114,3 +4450,73 @@ char *reg_by_prefix(int prefix) {
    printf("illegal prefix %x\n", prefix);
    return "";
 }
+
+int z80_instr_index(int prefix, int opcode) {
+   switch (prefix) {
+   case 0:
+      return 0x000 | opcode;
+   case 0xCB:
+      return 0x100 | opcode;
+   case 0xED:
+      return 0x200 | opcode;
+   case 0xDD:
+      return 0x300 | opcode;
+   case 0xFD:
+      return 0x400 | opcode;
+   case 0xDDCB:
+      return 0x500 | opcode;
+   case 0xFDCB:
+      return 0x600 | opcode;
+   }
+   printf("illegal prefix %x\n", prefix);
+   return -1;
+}
+
+// Writes the generic form of an instruction, with the index register of
+// the prefix and n, nn, d and e in place of the operands of the mnemonic
+// template (e.g. "LD (IX+d),n"), returning the number of characters
+int z80_instr_name(char *buffer, int size, const InstrType *instr, int prefix) {
+   int len = 0;
+   // Undefined opcodes in blocks 0xDD and 0xFD act like the unprefixed opcode
+   if ((prefix == 0xDD || prefix == 0xFD) && instr->want_dis < 0) {
+      instr = &table_by_prefix(0)[instr - table_by_prefix(prefix)];
+      prefix = 0;
+   }
+   for (const char *p = instr->mnemonic; *p && len < size - 1; p++) {
+      const char *operand = NULL;
+      char c[2] = { *p, '\0' };
+      if (*p == '%' && p[1]) {
+         // Skip the flags and width of the conversion
+         int width = 0;
+         while (p[1] && strchr("+0123456789", p[1])) {
+            p++;
+            width = *p == '4' ? 2 : *p == '2' ? 1 : width;
+         }
+         p++;
+         if (*p == 's') {
+            operand = instr->format == TYPE_7 ? "e" : reg_by_prefix(prefix);
+         } else if (*p == 'd') {
+            operand = "+d";
+         } else {
+            operand = width == 2 ? "nn" : "n";
+            // Drop the h suffix of a hex operand
+            if (p[1] == 'h') {
+               p++;
+            }
+         }
+      }
+      len += snprintf(buffer + len, size - len, "%s", operand ? operand : c);
+   }
+   buffer[len < size ? len : size - 1] = '\0';
+   return len;
+}
+
+// ===================================================================
+// Emulation dispatch
+// ===================================================================
+
+void z80_emulate(const InstrType *instr) {
+   if (instr && instr->emulate) {
+      instr->emulate(instr);
+   }
+}
@@ -1,11 +1,11 @@
 #ifndef _INCLUDE_EM_Z80_H
 #define _INCLUDE_EM_Z80_H
 
+#include <stdint.h>
+
 // Change bus cycle ordering of EX (SP),HL
 // #define T80
 
-//#define MEMORY_MODELLING
-
 //#define MEMORY_DEBUG
 
 #define False 0
@@ -43,29 +43,50 @@ typedef struct Instr {
    int conditional;
    FormatType format;
    const char *mnemonic;
-   void (*emulate)(struct Instr *);
-   int count;
+   void (*emulate)(const struct Instr *);
 } InstrType;
 
-extern InstrType z80_interrupt_int;
-extern InstrType z80_interrupt_nmi;
+// Types of bus access recorded in the bus access log
+#define BUS_MEM_READ  0
+#define BUS_MEM_WRITE 1
+#define BUS_IO_READ   2
+#define BUS_IO_WRITE  3
+
+typedef struct {
+   int type;
+   int addr;   // -1 if unknown
+   int data;
+} BusAccessType;
+
+// Number of distinct (prefix, opcode) pairs, i.e. seven tables of 256 entries
+#define NUM_INSTR_INDEX (7 * 256)
 
-InstrType *table_by_prefix(int prefix);
+extern const InstrType z80_interrupt_int;
+extern const InstrType z80_interrupt_nmi;
+
+const InstrType *table_by_prefix(int prefix);
 char *reg_by_prefix(int prefix);
+int z80_instr_index(int prefix, int opcode);
+int z80_instr_name(char *buffer, int size, const InstrType *instr, int prefix);
+void z80_emulate(const InstrType *instr);
+int z80_block_run_start();
+int z80_block_run_ends(int iteration, int data);
+void z80_emulate_block_run(const InstrType *instr, const uint8_t *rd, const uint8_t *wr, int n);
 char *z80_get_state(int verbosity);
-void z80_init(int cpu_type, int default_im);
+int z80_state_known();
+void z80_init(int cpu_type, int default_im, int mem_model_enabled);
 void z80_reset();
 int z80_get_pc();
+int z80_get_sp();
 int z80_get_im();
+int z80_reg_index(const char *name);
+int z80_get_reg(int index);
 void z80_increment_r();
 int z80_halted();
-
-#ifdef MEMORY_MODELLING
 void z80_clear_mem_log();
 void z80_dump_mem_log();
-#else
-#define z80_clear_mem_log(...)
-#define z80_dump_mem_log(...)
-#endif
+void z80_set_bus_log(int enabled);
+void z80_clear_bus_log();
+int z80_get_bus_log(const BusAccessType **log);
 
 #endif
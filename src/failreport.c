@@ -0,0 +1,307 @@
+//
+// Emulation failure report
+//
+// For each (prefix, opcode) pair, and for INT and NMI acknowledges, this
+// counts the executions and the failures of each kind. The first few
+// failures are recorded individually, with the sample number, PC and the
+// state after the instruction.
+//
+// After a failure of an instruction that started with the state fully
+// known, the number of instructions until every register and flag is known
+// again is the convergence distance. Failures that occur before the state
+// has converged belong to the same episode. Failures while the state was
+// not yet known (e.g. just after reset) are counted, but don't start an
+// episode, as the distance would only measure the start up. Sampling
+// problems tend to give isolated failures that converge at once, while
+// emulator bugs tend to repeat at the same opcode.
+//
+// The report is written at exit as JSON.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "failreport.h"
+
+// Interrupts are recorded after the seven opcode tables
+#define INDEX_INT    (NUM_INSTR_INDEX)
+#define INDEX_NMI    (NUM_INSTR_INDEX + 1)
+#define NUM_INDEX    (NUM_INSTR_INDEX + 2)
+
+#define NUM_FAIL_BITS 4
+
+// Convergence distances are counted in power of two buckets
+#define NUM_DISTANCE_BUCKETS 24
+
+#define MAX_STATE 128
+
+typedef struct {
+   uint64_t count;
+   uint64_t failures;
+   uint64_t fail[NUM_FAIL_BITS];
+} FailStatsType;
+
+typedef struct {
+   uint64_t instr_num;
+   uint64_t sample;
+   int pc;
+   int index;
+   int failflag;
+   int known;          // whether the state was known before the instruction
+   int64_t distance;   // -1 until the state has converged
+   char state[MAX_STATE];
+} OccurrenceType;
+
+static FailStatsType stats[NUM_INDEX];
+
+static uint64_t fail_bits[NUM_FAIL_BITS];
+
+static uint64_t num_instructions = 0;
+
+static uint64_t num_failures = 0;
+
+static OccurrenceType *occurrences = NULL;
+static int max_occurrences = 0;
+static int num_occurrences = 0;
+
+// Whether the state was fully known after the previous instruction
+static int state_known = 0;
+
+// Failures that occurred while the state was not known
+static uint64_t unknown_failures = 0;
+
+// The episode waiting for the state to converge
+static int pending = 0;
+static uint64_t pending_start;
+
+// The convergence distances of the completed episodes
+static uint64_t num_episodes = 0;
+static uint64_t total_distance = 0;
+static uint64_t min_distance = 0;
+static uint64_t max_distance = 0;
+static uint64_t distance_hist[NUM_DISTANCE_BUCKETS];
+
+// The prefix of each table, in z80_instr_index() order
+static const int prefixes[] = { 0x00, 0xCB, 0xED, 0xDD, 0xFD, 0xDDCB, 0xFDCB };
+
+static const char *fail_names[NUM_FAIL_BITS] = {
+   "error",
+   "memory",
+   "not_implemented",
+   "implementation_error"
+};
+
+static int fail_index(const InstrType *instr, int prefix, int opcode) {
+   if (instr == &z80_interrupt_int) {
+      return INDEX_INT;
+   } else if (instr == &z80_interrupt_nmi) {
+      return INDEX_NMI;
+   } else {
+      return z80_instr_index(prefix, opcode);
+   }
+}
+
+int failreport_init(int max) {
+   occurrences = calloc(max, sizeof(OccurrenceType));
+   if (!occurrences) {
+      perror("failed to allocate fail report");
+      return 1;
+   }
+   max_occurrences = max;
+   return 0;
+}
+
+static void converged() {
+   uint64_t distance = num_instructions - pending_start;
+   int bucket = 0;
+   while (bucket < NUM_DISTANCE_BUCKETS - 1 && (distance >> bucket) > 0) {
+      bucket++;
+   }
+   if (num_episodes == 0 || distance < min_distance) {
+      min_distance = distance;
+   }
+   if (distance > max_distance) {
+      max_distance = distance;
+   }
+   num_episodes++;
+   total_distance += distance;
+   distance_hist[bucket]++;
+   for (int i = num_occurrences - 1; i >= 0 && occurrences[i].instr_num >= pending_start; i--) {
+      occurrences[i].distance = num_instructions - occurrences[i].instr_num;
+   }
+   pending = 0;
+}
+
+// Called after each emulated instruction (which started at pc and sample)
+void failreport_instruction(const InstrType *instr, int prefix, int opcode, int failflag, int pc, uint64_t sample) {
+   int index = fail_index(instr, prefix, opcode);
+   FailStatsType *s = &stats[index];
+   num_instructions++;
+   s->count++;
+   if (failflag) {
+      s->failures++;
+      num_failures++;
+      for (int i = 0; i < NUM_FAIL_BITS; i++) {
+         if (failflag & (1 << i)) {
+            s->fail[i]++;
+            fail_bits[i]++;
+         }
+      }
+      if (num_occurrences < max_occurrences) {
+         OccurrenceType *o = &occurrences[num_occurrences++];
+         o->instr_num = num_instructions;
+         o->sample    = sample;
+         o->pc        = pc;
+         o->index     = index;
+         o->failflag  = failflag;
+         o->known     = state_known;
+         o->distance  = -1;
+         snprintf(o->state, sizeof(o->state), "%s", z80_get_state(2));
+      }
+      if (!pending && state_known) {
+         pending = 1;
+         pending_start = num_instructions;
+      } else if (!pending) {
+         unknown_failures++;
+      }
+   }
+   state_known = z80_state_known();
+   if (pending && state_known) {
+      converged();
+   }
+}
+
+// ===================================================================
+// Output
+// ===================================================================
+
+// Returns the generic form of the instruction (e.g. "LD BC,nn"), which is
+// valid until the next call
+static const char *index_mnemonic(int index) {
+   static char name[32];
+   if (index == INDEX_INT) {
+      return "INT";
+   } else if (index == INDEX_NMI) {
+      return "NMI";
+   } else {
+      int prefix = prefixes[index >> 8];
+      z80_instr_name(name, sizeof(name), &table_by_prefix(prefix)[index & 0xff], prefix);
+      return name;
+   }
+}
+
+static void index_prefix_opcode(int index, char *prefix, char *opcode) {
+   if (index >= NUM_INSTR_INDEX) {
+      *prefix = '\0';
+      *opcode = '\0';
+   } else {
+      sprintf(prefix, "%02X", prefixes[index >> 8]);
+      sprintf(opcode, "%02X", index & 0xff);
+   }
+}
+
+static void write_fail_bits(FILE *stream, const uint64_t *fail) {
+   fprintf(stream, "{");
+   for (int i = 0; i < NUM_FAIL_BITS; i++) {
+      fprintf(stream, "%s\"%s\": %" PRIu64, i ? ", " : "", fail_names[i], fail[i]);
+   }
+   fprintf(stream, "}");
+}
+
+static void write_convergence(FILE *stream) {
+   fprintf(stream, "  \"convergence\": {\"episodes\": %" PRIu64 ", \"unconverged\": %d, \"state_unknown_failures\": %" PRIu64 ", ",
+           num_episodes, pending, unknown_failures);
+   if (num_episodes) {
+      fprintf(stream, "\"min\": %" PRIu64 ", \"max\": %" PRIu64 ", \"mean\": %.3f, ",
+              min_distance, max_distance, (double) total_distance / (double) num_episodes);
+   }
+   fprintf(stream, "\"histogram\": {");
+   int first = 1;
+   for (int i = 0; i < NUM_DISTANCE_BUCKETS; i++) {
+      if (!distance_hist[i]) {
+         continue;
+      }
+      // Bucket i holds the distances below 2^i, from 2^(i-1)
+      uint64_t lo = i ? 1ull << (i - 1) : 0;
+      uint64_t hi = i ? (1ull << i) - 1 : 0;
+      if (i == NUM_DISTANCE_BUCKETS - 1) {
+         fprintf(stream, "%s\"%" PRIu64 "+\": %" PRIu64, first ? "" : ", ", lo, distance_hist[i]);
+      } else if (lo == hi) {
+         fprintf(stream, "%s\"%" PRIu64 "\": %" PRIu64, first ? "" : ", ", lo, distance_hist[i]);
+      } else {
+         fprintf(stream, "%s\"%" PRIu64 "-%" PRIu64 "\": %" PRIu64, first ? "" : ", ", lo, hi, distance_hist[i]);
+      }
+      first = 0;
+   }
+   fprintf(stream, "}},\n");
+}
+
+static void write_json(FILE *stream) {
+   char prefix[8];
+   char opcode[8];
+   fprintf(stream, "{\n");
+   fprintf(stream, "  \"instructions\": %" PRIu64 ",\n", num_instructions);
+   fprintf(stream, "  \"failures\": %" PRIu64 ",\n", num_failures);
+   fprintf(stream, "  \"fail\": ");
+   write_fail_bits(stream, fail_bits);
+   fprintf(stream, ",\n");
+   write_convergence(stream);
+   fprintf(stream, "  \"opcodes\": [");
+   int first = 1;
+   for (int index = 0; index < NUM_INDEX; index++) {
+      FailStatsType *s = &stats[index];
+      if (s->failures == 0) {
+         continue;
+      }
+      index_prefix_opcode(index, prefix, opcode);
+      fprintf(stream, "%s\n    {\"prefix\": \"%s\", \"opcode\": \"%s\", \"mnemonic\": \"%s\", ",
+              first ? "" : ",", prefix, opcode, index_mnemonic(index));
+      fprintf(stream, "\"count\": %" PRIu64 ", \"failures\": %" PRIu64 ", \"fail\": ", s->count, s->failures);
+      write_fail_bits(stream, s->fail);
+      fprintf(stream, "}");
+      first = 0;
+   }
+   fprintf(stream, "\n  ],\n");
+   fprintf(stream, "  \"occurrences\": [");
+   for (int i = 0; i < num_occurrences; i++) {
+      OccurrenceType *o = &occurrences[i];
+      index_prefix_opcode(o->index, prefix, opcode);
+      fprintf(stream, "%s\n    {\"instruction\": %" PRIu64 ", \"sample\": %" PRIu64 ", ",
+              i ? "," : "", o->instr_num, o->sample);
+      if (o->pc >= 0) {
+         fprintf(stream, "\"pc\": \"%04X\", ", o->pc);
+      } else {
+         fprintf(stream, "\"pc\": null, ");
+      }
+      fprintf(stream, "\"prefix\": \"%s\", \"opcode\": \"%s\", \"mnemonic\": \"%s\", \"fail\": [",
+              prefix, opcode, index_mnemonic(o->index));
+      int first_bit = 1;
+      for (int j = 0; j < NUM_FAIL_BITS; j++) {
+         if (o->failflag & (1 << j)) {
+            fprintf(stream, "%s\"%s\"", first_bit ? "" : ", ", fail_names[j]);
+            first_bit = 0;
+         }
+      }
+      fprintf(stream, "], \"state_known\": %s, \"state\": \"%s\", ", o->known ? "true" : "false", o->state);
+      if (o->distance >= 0) {
+         fprintf(stream, "\"converged_after\": %" PRId64 "}", o->distance);
+      } else {
+         fprintf(stream, "\"converged_after\": null}");
+      }
+   }
+   fprintf(stream, "\n  ]\n}\n");
+}
+
+int failreport_write(const char *filename) {
+   FILE *stream = fopen(filename, "w");
+   if (!stream) {
+      perror("failed to open fail report file");
+      return 1;
+   }
+   write_json(stream);
+   if (fclose(stream)) {
+      perror("failed to write fail report file");
+      return 1;
+   }
+   return 0;
+}
@@ -0,0 +1,11 @@
+#ifndef _INCLUDE_FAILREPORT_H
+#define _INCLUDE_FAILREPORT_H
+
+#include <stdint.h>
+#include "em_z80.h"
+
+int  failreport_init(int max_occurrences);
+void failreport_instruction(const InstrType *instr, int prefix, int opcode, int failflag, int pc, uint64_t sample);
+int  failreport_write(const char *filename);
+
+#endif
@@ -0,0 +1,376 @@
+//
+// Filter expressions for the disassembly
+//
+// A filter selects the instructions that are output. It is evaluated once
+// the instruction has been emulated but before any text is formatted, so
+// instructions that do not match only cost the emulation. Expressions are
+// compiled to a small stack based bytecode, and those that only test the
+// PC are evaluated for every address up front, giving a 64K bitmap.
+//
+// Predicates are combined with ! && || (or not and or) and parentheses:
+//
+//   pc=START[-END]     the instruction address is in the range
+//   ea=START[-END]     a memory read or write (not a fetch) is in the range
+//   port=START[-END]   an IO access is to a port (the low eight bits of the
+//                      address) in the range
+//   REG OP VALUE       a register after the instruction compares with VALUE,
+//                      where OP is == != < <= > or >=; false when the
+//                      register is unknown
+//   CLASS              one of io in out mem read write branch call ret int
+//                      block halt fail, where mem, read and write are the
+//                      operand accesses (not the instruction bytes)
+//
+// e.g. "write && ea=0x4000-0x43ff" or "call && !pc=0x0000-0x1fff". When
+// several filters are given, all of them must match.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include "filter.h"
+
+#define MAX_OPS   256
+#define MAX_NAME   16
+
+typedef enum {
+   OP_PC,
+   OP_EA,
+   OP_PORT,
+   OP_REG,
+   OP_CLASS,
+   OP_NOT,
+   OP_AND,
+   OP_OR
+} OpCodeType;
+
+typedef enum {
+   CMP_EQ,
+   CMP_NE,
+   CMP_LT,
+   CMP_LE,
+   CMP_GT,
+   CMP_GE
+} CompareType;
+
+typedef struct {
+   OpCodeType op;
+   int arg;   // the class mask, or the register index
+   CompareType cmp;
+   int lo;
+   int hi;
+} FilterOpType;
+
+static const struct {
+   const char *name;
+   int mask;
+} class_names[] = {
+   { "io",     FILTER_IN | FILTER_OUT     },
+   { "in",     FILTER_IN                  },
+   { "out",    FILTER_OUT                 },
+   { "mem",    FILTER_READ | FILTER_WRITE },
+   { "read",   FILTER_READ                },
+   { "write",  FILTER_WRITE               },
+   { "branch", FILTER_BRANCH              },
+   { "call",   FILTER_CALL                },
+   { "ret",    FILTER_RET                 },
+   { "int",    FILTER_INT                 },
+   { "block",  FILTER_BLOCK               },
+   { "halt",   FILTER_HALT                },
+   { "fail",   FILTER_FAIL                }
+};
+
+// The comparison operators, longest first
+static const struct {
+   const char *name;
+   CompareType cmp;
+} compare_names[] = {
+   { "==", CMP_EQ },
+   { "!=", CMP_NE },
+   { "<=", CMP_LE },
+   { ">=", CMP_GE },
+   { "<",  CMP_LT },
+   { ">",  CMP_GT }
+};
+
+static FilterOpType program[MAX_OPS];
+
+static int num_ops = 0;
+
+static int uses_bus = 0;
+
+static int uses_classes = 0;
+
+// Set when the program only tests the PC, so the bitmap can be used
+static int pc_only = 1;
+
+static uint8_t pc_bitmap[0x10000 >> 3];
+
+// The parse position
+static const char *pos;
+
+// ===================================================================
+// Expression parsing
+// ===================================================================
+
+static void skip_space() {
+   while (isspace((unsigned char) *pos)) {
+      pos++;
+   }
+}
+
+// Consumes token if it is next; a word must not run on into an identifier
+static int accept(const char *token) {
+   int n = strlen(token);
+   skip_space();
+   if (strncmp(pos, token, n) || (isalpha((unsigned char) token[n - 1]) && isalnum((unsigned char) pos[n]))) {
+      return 0;
+   }
+   pos += n;
+   return 1;
+}
+
+static int emit(OpCodeType op, int arg, CompareType cmp, int lo, int hi) {
+   if (num_ops == MAX_OPS) {
+      return 1;
+   }
+   FilterOpType *ins = &program[num_ops++];
+   ins->op  = op;
+   ins->arg = arg;
+   ins->cmp = cmp;
+   ins->lo  = lo;
+   ins->hi  = hi;
+   return 0;
+}
+
+static int parse_number(int *value, int max) {
+   char *end;
+   skip_space();
+   long n = strtol(pos, &end, 0);
+   if (end == pos || n < 0 || n > max) {
+      return 1;
+   }
+   pos = end;
+   *value = (int) n;
+   return 0;
+}
+
+static int parse_range(int *lo, int *hi, int max) {
+   if (!accept("==") && !accept("=")) {
+      return 1;
+   }
+   if (parse_number(lo, max)) {
+      return 1;
+   }
+   *hi = *lo;
+   if (accept("-") && parse_number(hi, max)) {
+      return 1;
+   }
+   return *lo > *hi;
+}
+
+static int parse_predicate() {
+   char name[MAX_NAME];
+   int n = 0;
+   int lo;
+   int hi;
+   skip_space();
+   while (isalpha((unsigned char) pos[n])) {
+      n++;
+   }
+   if (n == 0 || n >= MAX_NAME) {
+      return 1;
+   }
+   memcpy(name, pos, n);
+   name[n] = '\0';
+   pos += n;
+   if (!strcasecmp(name, "pc")) {
+      return parse_range(&lo, &hi, 0xffff) || emit(OP_PC, 0, 0, lo, hi);
+   }
+   if (!strcasecmp(name, "ea") || !strcasecmp(name, "port")) {
+      int port = !strcasecmp(name, "port");
+      pc_only = 0;
+      uses_bus = 1;
+      return parse_range(&lo, &hi, port ? 0xff : 0xffff) || emit(port ? OP_PORT : OP_EA, 0, 0, lo, hi);
+   }
+   for (int i = 0; i < sizeof(class_names) / sizeof(class_names[0]); i++) {
+      if (!strcasecmp(name, class_names[i].name)) {
+         pc_only = 0;
+         uses_classes = 1;
+         return emit(OP_CLASS, class_names[i].mask, 0, 0, 0);
+      }
+   }
+   int reg = z80_reg_index(name);
+   if (reg < 0) {
+      // Leave the position at the unknown name
+      pos -= n;
+      return 1;
+   }
+   pc_only = 0;
+   for (int i = 0; i < sizeof(compare_names) / sizeof(compare_names[0]); i++) {
+      if (accept(compare_names[i].name)) {
+         return parse_number(&lo, 0xffff) || emit(OP_REG, reg, compare_names[i].cmp, lo, lo);
+      }
+   }
+   return 1;
+}
+
+static int parse_or();
+
+static int parse_unary() {
+   if (accept("!") || accept("not")) {
+      return parse_unary() || emit(OP_NOT, 0, 0, 0, 0);
+   }
+   if (accept("(")) {
+      return parse_or() || !accept(")");
+   }
+   return parse_predicate();
+}
+
+static int parse_and() {
+   if (parse_unary()) {
+      return 1;
+   }
+   while (accept("&&") || accept("and")) {
+      if (parse_unary() || emit(OP_AND, 0, 0, 0, 0)) {
+         return 1;
+      }
+   }
+   return 0;
+}
+
+static int parse_or() {
+   if (parse_and()) {
+      return 1;
+   }
+   while (accept("||") || accept("or")) {
+      if (parse_and() || emit(OP_OR, 0, 0, 0, 0)) {
+         return 1;
+      }
+   }
+   return 0;
+}
+
+// ===================================================================
+// Evaluation
+// ===================================================================
+
+// Returns whether any access in the log of the given space (memory or IO)
+// has an address in the range
+static int bus_in_range(const BusAccessType *bus, int num_bus, int io, int lo, int hi) {
+   for (int i = 0; i < num_bus; i++) {
+      int addr = bus[i].addr;
+      if (addr >= 0 && (bus[i].type == BUS_IO_READ || bus[i].type == BUS_IO_WRITE) == io) {
+         if (io) {
+            addr &= 0xff;
+         }
+         if (addr >= lo && addr <= hi) {
+            return 1;
+         }
+      }
+   }
+   return 0;
+}
+
+static int compare(int value, CompareType cmp, int operand) {
+   if (value < 0) {
+      return 0;
+   }
+   switch (cmp) {
+   case CMP_EQ:
+      return value == operand;
+   case CMP_NE:
+      return value != operand;
+   case CMP_LT:
+      return value < operand;
+   case CMP_LE:
+      return value <= operand;
+   case CMP_GT:
+      return value > operand;
+   case CMP_GE:
+      return value >= operand;
+   }
+   return 0;
+}
+
+static int evaluate(int pc, int classes, const BusAccessType *bus, int num_bus) {
+   int stack[MAX_OPS];
+   int sp = 0;
+   for (int i = 0; i < num_ops; i++) {
+      const FilterOpType *ins = &program[i];
+      switch (ins->op) {
+      case OP_PC:
+         stack[sp++] = pc >= ins->lo && pc <= ins->hi;
+         break;
+      case OP_EA:
+         stack[sp++] = bus_in_range(bus, num_bus, 0, ins->lo, ins->hi);
+         break;
+      case OP_PORT:
+         stack[sp++] = bus_in_range(bus, num_bus, 1, ins->lo, ins->hi);
+         break;
+      case OP_REG:
+         stack[sp++] = compare(z80_get_reg(ins->arg), ins->cmp, ins->lo);
+         break;
+      case OP_CLASS:
+         stack[sp++] = (classes & ins->arg) != 0;
+         break;
+      case OP_NOT:
+         stack[sp - 1] = !stack[sp - 1];
+         break;
+      case OP_AND:
+         sp--;
+         stack[sp - 1] = stack[sp - 1] && stack[sp];
+         break;
+      case OP_OR:
+         sp--;
+         stack[sp - 1] = stack[sp - 1] || stack[sp];
+         break;
+      }
+   }
+   return stack[0];
+}
+
+// ===================================================================
+// Public interface
+// ===================================================================
+
+// Compiles an expression, which is combined with any previous ones. On
+// failure, error points to where parsing stopped.
+int filter_compile(const char *expr, const char **error) {
+   int start = num_ops;
+   pos = expr;
+   if (parse_or() || (skip_space(), *pos) || (start && emit(OP_AND, 0, 0, 0, 0))) {
+      *error = pos;
+      num_ops = start;
+      return 1;
+   }
+   if (pc_only) {
+      for (int pc = 0; pc < 0x10000; pc++) {
+         if (evaluate(pc, 0, NULL, 0)) {
+            pc_bitmap[pc >> 3] |= 1 << (pc & 7);
+         } else {
+            pc_bitmap[pc >> 3] &= ~(1 << (pc & 7));
+         }
+      }
+   }
+   return 0;
+}
+
+// Whether the filter needs the bus access log of each instruction
+int filter_uses_bus() {
+   return uses_bus;
+}
+
+// Whether the filter needs the classes of each instruction
+int filter_uses_classes() {
+   return uses_classes;
+}
+
+// Returns whether the instruction at pc (-1 if unknown) matches
+int filter_match(int pc, int classes, const BusAccessType *bus, int num_bus) {
+   if (pc_only && pc >= 0) {
+      return (pc_bitmap[pc >> 3] >> (pc & 7)) & 1;
+   }
+   return evaluate(pc, classes, bus, num_bus);
+}
@@ -0,0 +1,24 @@
+#ifndef _INCLUDE_FILTER_H
+#define _INCLUDE_FILTER_H
+
+#include "em_z80.h"
+
+// Instruction classes tested by filters
+#define FILTER_IN     0x001
+#define FILTER_OUT    0x002
+#define FILTER_READ   0x004
+#define FILTER_WRITE  0x008
+#define FILTER_BRANCH 0x010
+#define FILTER_CALL   0x020
+#define FILTER_RET    0x040
+#define FILTER_INT    0x080
+#define FILTER_BLOCK  0x100
+#define FILTER_HALT   0x200
+#define FILTER_FAIL   0x400
+
+int filter_compile(const char *expr, const char **error);
+int filter_uses_bus();
+int filter_uses_classes();
+int filter_match(int pc, int classes, const BusAccessType *bus, int num_bus);
+
+#endif
@@ -0,0 +1,352 @@
+//
+// Interrupt service statistics
+//
+// Each INT or NMI acknowledge opens an interrupt service frame, holding
+// the interrupted PC (the address pushed onto the stack). The frame ends
+// when that return address is popped, normally by the RETI/RETN/RET that
+// restores the interrupted PC, following the shadow stack rules of the
+// call graph (so if SP is not known, a return to the interrupted PC ends
+// the frame instead). A frame that ends with the PC somewhere else is
+// counted as abandoned (e.g. the handler discarded the return address).
+//
+// Interrupts are grouped by type and handler address. For each group, the
+// interval between acknowledges, the acknowledge cycle length and the
+// service duration (from the acknowledge to the end of the frame) are
+// recorded, all in T-states, along with the nesting depth. At exit the
+// distributions are summarised, including the worst case service
+// duration, and the jitter (standard deviation) of the interval. The
+// output is CSV if the filename ends in .csv, and otherwise JSON.
+//
+// The values are counted in fixed histograms rather than kept, so the
+// memory used doesn't grow with the length of the capture. The buckets are
+// exact below 32 T-states and then split each power of two into 16, so the
+// percentiles are within about 3% (the minimum, maximum, mean and standard
+// deviation are exact).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <inttypes.h>
+#include <math.h>
+#include "callgraph.h"
+#include "intstats.h"
+
+#define MAX_GROUPS  64
+
+#define MAX_NESTING 64
+
+// The output histograms have a bucket for each power of two
+#define NUM_BUCKETS 40
+
+// Each power of two above 32 is split into this many buckets
+#define SUB_BITS    4
+#define SUB_BUCKETS (1 << SUB_BITS)
+
+#define NUM_SERIES_BUCKETS ((64 - SUB_BITS + 1) * SUB_BUCKETS)
+
+typedef struct {
+   uint64_t n;
+   uint64_t min;
+   uint64_t max;
+   double sum;
+   double sum_sq;
+   uint64_t counts[NUM_SERIES_BUCKETS];
+} SeriesType;
+
+typedef struct {
+   int kind;
+   int vector;
+   uint64_t count;
+   uint64_t last_start;
+   SeriesType interval;
+   SeriesType ack;
+   SeriesType duration;
+   uint64_t nested;
+   int max_depth;
+   uint64_t abandoned;
+   uint64_t worst;
+   int worst_pc;
+   uint64_t worst_time;
+} GroupType;
+
+typedef struct {
+   int group;
+   uint64_t start;
+} IsrFrameType;
+
+static GroupType groups[MAX_GROUPS];
+static int num_groups = 0;
+
+static ShadowFrameType frames[MAX_NESTING];
+static IsrFrameType isr_frames[MAX_NESTING];
+static int depth = 0;
+
+// The number of T-states since the start of the capture
+static uint64_t now = 0;
+
+static int log2_floor(uint64_t value) {
+   int bits = 0;
+   while (value >>= 1) {
+      bits++;
+   }
+   return bits;
+}
+
+static int series_bucket(uint64_t value) {
+   if (value < 2 * SUB_BUCKETS) {
+      return (int) value;
+   }
+   int shift = log2_floor(value) - SUB_BITS;
+   return shift * SUB_BUCKETS + (int) (value >> shift);
+}
+
+// The smallest value counted in the bucket, and the number of values
+static uint64_t bucket_low(int bucket, uint64_t *width) {
+   if (bucket < 2 * SUB_BUCKETS) {
+      *width = 1;
+      return bucket;
+   }
+   int shift = bucket / SUB_BUCKETS - 1;
+   *width = 1ull << shift;
+   return (uint64_t) (bucket % SUB_BUCKETS + SUB_BUCKETS) << shift;
+}
+
+static void add_value(SeriesType *series, uint64_t value) {
+   if (!series->n || value < series->min) {
+      series->min = value;
+   }
+   if (value > series->max) {
+      series->max = value;
+   }
+   series->n++;
+   series->sum    += (double) value;
+   series->sum_sq += (double) value * (double) value;
+   series->counts[series_bucket(value)]++;
+}
+
+static GroupType *find_group(int kind, int vector) {
+   for (int i = 0; i < num_groups; i++) {
+      if (groups[i].kind == kind && groups[i].vector == vector) {
+         return &groups[i];
+      }
+   }
+   if (num_groups == MAX_GROUPS) {
+      return NULL;
+   }
+   GroupType *group = &groups[num_groups++];
+   group->kind     = kind;
+   group->vector   = vector;
+   group->worst_pc = -1;
+   return group;
+}
+
+static void end_frame(int pc) {
+   depth--;
+   IsrFrameType *frame = &isr_frames[depth];
+   GroupType *group = &groups[frame->group];
+   uint64_t duration = now - frame->start;
+   add_value(&group->duration, duration);
+   if (pc != frames[depth].return_addr) {
+      group->abandoned++;
+   }
+   if (duration > group->worst) {
+      group->worst      = duration;
+      group->worst_pc   = frames[depth].return_addr;
+      group->worst_time = frame->start;
+   }
+}
+
+void intstats_instruction(int kind, int target, int return_addr, int pc, int sp, int instr_cycles) {
+   uint64_t start = now;
+   now += instr_cycles;
+   if (kind == CG_INT || kind == CG_NMI) {
+      GroupType *group = find_group(kind, target);
+      if (!group) {
+         return;
+      }
+      if (group->count) {
+         add_value(&group->interval, start - group->last_start);
+      }
+      group->count++;
+      group->last_start = start;
+      add_value(&group->ack, instr_cycles);
+      if (depth) {
+         group->nested++;
+      }
+      if (depth + 1 > group->max_depth) {
+         group->max_depth = depth + 1;
+      }
+      if (depth < MAX_NESTING) {
+         frames[depth].return_addr = return_addr;
+         frames[depth].sp          = sp;
+         isr_frames[depth].group   = group - groups;
+         isr_frames[depth].start   = start;
+         depth++;
+      }
+      return;
+   }
+   int new_depth = shadow_stack_depth(frames, depth, kind, target, sp);
+   while (depth > new_depth) {
+      end_frame(pc);
+   }
+}
+
+// ===================================================================
+// Output
+// ===================================================================
+
+typedef struct {
+   uint64_t n;
+   uint64_t min;
+   uint64_t max;
+   double mean;
+   double stddev;
+   uint64_t p50;
+   uint64_t p90;
+   uint64_t p99;
+   uint64_t hist[NUM_BUCKETS];
+   int num_buckets;
+} SummaryType;
+
+// Returns the middle of the bucket holding the percentile
+static uint64_t percentile(SeriesType *series, int percent) {
+   uint64_t rank = (series->n * percent + 99) / 100;
+   uint64_t seen = 0;
+   for (int i = 0; i < NUM_SERIES_BUCKETS; i++) {
+      seen += series->counts[i];
+      if (seen >= rank && series->counts[i]) {
+         uint64_t width;
+         uint64_t value = bucket_low(i, &width) + (width - 1) / 2;
+         return value < series->min ? series->min : value > series->max ? series->max : value;
+      }
+   }
+   return series->max;
+}
+
+static void summarise(SeriesType *series, SummaryType *summary) {
+   memset(summary, 0, sizeof(SummaryType));
+   summary->n = series->n;
+   if (!series->n) {
+      return;
+   }
+   for (int i = 0; i < NUM_SERIES_BUCKETS; i++) {
+      if (!series->counts[i]) {
+         continue;
+      }
+      // The buckets never span a power of two
+      uint64_t width;
+      int bucket = log2_floor(bucket_low(i, &width));
+      if (bucket > NUM_BUCKETS - 1) {
+         bucket = NUM_BUCKETS - 1;
+      }
+      summary->hist[bucket] += series->counts[i];
+      if (bucket + 1 > summary->num_buckets) {
+         summary->num_buckets = bucket + 1;
+      }
+   }
+   summary->min    = series->min;
+   summary->max    = series->max;
+   summary->mean   = series->sum / series->n;
+   summary->stddev = sqrt(fmax(0.0, series->sum_sq / series->n - summary->mean * summary->mean));
+   summary->p50    = percentile(series, 50);
+   summary->p90    = percentile(series, 90);
+   summary->p99    = percentile(series, 99);
+}
+
+static const char *kind_name(int kind) {
+   return kind == CG_NMI ? "NMI" : "INT";
+}
+
+static void write_json_summary(FILE *stream, const char *name, SummaryType *summary, const char *sep) {
+   fprintf(stream, "      \"%s\": {\"n\": %" PRIu64 ", \"min\": %" PRIu64 ", \"max\": %" PRIu64 ", \"mean\": %.3f, \"stddev\": %.3f, ",
+           name, summary->n, summary->min, summary->max, summary->mean, summary->stddev);
+   fprintf(stream, "\"p50\": %" PRIu64 ", \"p90\": %" PRIu64 ", \"p99\": %" PRIu64 ", \"log2_histogram\": [",
+           summary->p50, summary->p90, summary->p99);
+   for (int i = 0; i < summary->num_buckets; i++) {
+      fprintf(stream, "%s%" PRIu64, i ? ", " : "", summary->hist[i]);
+   }
+   fprintf(stream, "]}%s\n", sep);
+}
+
+static void write_csv_summary(FILE *stream, SummaryType *summary) {
+   fprintf(stream, ",%" PRIu64 ",%" PRIu64 ",%.3f,%.3f,%" PRIu64 ",%" PRIu64 ",%" PRIu64,
+           summary->min, summary->max, summary->mean, summary->stddev,
+           summary->p50, summary->p90, summary->p99);
+}
+
+int intstats_write(const char *filename) {
+   SummaryType interval;
+   SummaryType ack;
+   SummaryType duration;
+   FILE *stream = fopen(filename, "w");
+   if (!stream) {
+      perror("failed to open interrupt statistics file");
+      return 1;
+   }
+   int len = strlen(filename);
+   int csv = len >= 4 && !strcasecmp(filename + len - 4, ".csv");
+   if (csv) {
+      fprintf(stream, "type,vector,count,rate_per_mtstate,nested,max_depth,abandoned,worst_pc,worst_time");
+      const char *series[] = { "interval", "ack", "duration" };
+      const char *fields[] = { "min", "max", "mean", "stddev", "p50", "p90", "p99" };
+      for (int i = 0; i < 3; i++) {
+         for (int j = 0; j < 7; j++) {
+            fprintf(stream, ",%s_%s", series[i], fields[j]);
+         }
+      }
+      fprintf(stream, "\n");
+   } else {
+      fprintf(stream, "{\n  \"tstates\": %" PRIu64 ",\n  \"interrupts\": [", now);
+   }
+   for (int i = 0; i < num_groups; i++) {
+      GroupType *group = &groups[i];
+      char vector[16];
+      char worst_pc[16];
+      if (group->vector >= 0) {
+         sprintf(vector, "%04X", group->vector);
+      } else {
+         sprintf(vector, "????");
+      }
+      if (group->worst_pc >= 0) {
+         sprintf(worst_pc, "%04X", group->worst_pc);
+      } else {
+         sprintf(worst_pc, "????");
+      }
+      double rate = now ? 1e6 * (double) group->count / (double) now : 0.0;
+      summarise(&group->interval, &interval);
+      summarise(&group->ack, &ack);
+      summarise(&group->duration, &duration);
+      if (csv) {
+         fprintf(stream, "%s,%s,%" PRIu64 ",%.3f,%" PRIu64 ",%d,%" PRIu64 ",%s,%" PRIu64,
+                 kind_name(group->kind), vector, group->count, rate, group->nested, group->max_depth,
+                 group->abandoned, worst_pc, group->worst_time);
+         write_csv_summary(stream, &interval);
+         write_csv_summary(stream, &ack);
+         write_csv_summary(stream, &duration);
+         fprintf(stream, "\n");
+      } else {
+         fprintf(stream, "%s\n    {\n", i ? "," : "");
+         fprintf(stream, "      \"type\": \"%s\", \"vector\": \"%s\", \"count\": %" PRIu64 ", \"rate_per_mtstate\": %.3f,\n",
+                 kind_name(group->kind), vector, group->count, rate);
+         fprintf(stream, "      \"nested\": %" PRIu64 ", \"max_depth\": %d, \"abandoned\": %" PRIu64 ",\n",
+                 group->nested, group->max_depth, group->abandoned);
+         fprintf(stream, "      \"worst\": {\"duration\": %" PRIu64 ", \"interrupted_pc\": ", group->worst);
+         if (group->worst_pc >= 0) {
+            fprintf(stream, "\"%s\"", worst_pc);
+         } else {
+            fprintf(stream, "null");
+         }
+         fprintf(stream, ", \"time\": %" PRIu64 "},\n", group->worst_time);
+         write_json_summary(stream, "interval", &interval, ",");
+         write_json_summary(stream, "ack", &ack, ",");
+         write_json_summary(stream, "duration", &duration, "");
+         fprintf(stream, "    }");
+      }
+   }
+   if (!csv) {
+      fprintf(stream, "\n  ]\n}\n");
+   }
+   fclose(stream);
+   return 0;
+}
@@ -0,0 +1,7 @@
+#ifndef _INCLUDE_INTSTATS_H
+#define _INCLUDE_INTSTATS_H
+
+void intstats_instruction(int kind, int target, int return_addr, int pc, int sp, int instr_cycles);
+int  intstats_write(const char *filename);
+
+#endif
@@ -3,10 +3,25 @@
 #include <inttypes.h>
 #include <argp.h>
 #include <string.h>
+#include <errno.h>
 
 #include "em_z80.h"
-
-// #define DUMP_COVERAGE
+#include "memmap.h"
+#include "stats.h"
+#include "profile.h"
+#include "callgraph.h"
+#include "busstats.h"
+#include "intstats.h"
+#include "stackstats.h"
+#include "coverage.h"
+#include "memimage.h"
+#include "symbols.h"
+#include "cfg.h"
+#include "metrics.h"
+#include "trace.h"
+#include "filter.h"
+#include "warnings.h"
+#include "failreport.h"
 
 #define MAX_INSTR_LEN 5
 
@@ -18,6 +33,13 @@
 
 #define SAMPLE_BUFSIZE 8192
 
+// Units for --time
+#define TIME_US 1
+#define TIME_NS 2
+
+// The largest number of cycles kept by the flight recorder
+#define FLIGHT_MAX_CYCLES 65536
+
 uint16_t buffer[READ_BUFSIZE];
 
 uint16_t sample_buffer[SAMPLE_BUFSIZE];
@@ -25,6 +47,9 @@ uint16_t sample_buffer[SAMPLE_BUFSIZE];
 // Whether to emulate each decoded instruction, to track additional state (registers and flags)
 int do_emulate = 0;
 
+// Whether the emulator logs the bus accesses of each instruction
+static int bus_log = 0;
+
 // ====================================================================
 // Argp processing
 // ====================================================================
@@ -49,6 +74,48 @@ Decoder for Z80 logic analyzer capture files.\n\
 
 static char args_doc[] = "[FILENAME]";
 
+// Keys for the options that only have a long form, above the printable
+// characters so that argp does not also give them a short form
+enum {
+   OPT_MEMORY_MODEL = 0x100,
+   OPT_MEMORY_MAP,
+   OPT_BLOCK_BULK,
+   OPT_BLOCK_SUMMARY,
+   OPT_STATS,
+   OPT_PROFILE,
+   OPT_PROFILE_TOP,
+   OPT_CALLGRIND,
+   OPT_FOLDED,
+   OPT_BUS_STATS,
+   OPT_BUS_REGION,
+   OPT_INT_STATS,
+   OPT_STACK_STATS,
+   OPT_COVERAGE,
+   OPT_COVERAGE_REPORT,
+   OPT_DUMP_MEMORY,
+   OPT_SYMBOLS,
+   OPT_COLLAPSE_LOOPS,
+   OPT_CFG,
+   OPT_SAMPLERATE,
+   OPT_METRICS,
+   OPT_METRICS_WINDOW,
+   OPT_IDLE,
+   OPT_TRACE,
+   OPT_START_SAMPLE,
+   OPT_STOP_SAMPLE,
+   OPT_START_PC,
+   OPT_STOP_PC,
+   OPT_STOP_AFTER,
+   OPT_STOP_ON_FAIL,
+   OPT_FILTER,
+   OPT_FLIGHT_RECORDER,
+   OPT_WARN_LIMIT,
+   OPT_WARN_SUMMARY,
+   OPT_WARN_ABORT,
+   OPT_FAIL_REPORT,
+   OPT_FAIL_FIRST
+};
+
 static struct argp_option options[] = {
    { "data",           1, "BITNUM",                   0, "The start bit number for data"},
    { "m1",             2, "BITNUM", OPTION_ARG_OPTIONAL, "The bit number for m1"},
@@ -61,12 +128,50 @@ static struct argp_option options[] = {
    { "phi",            9, "BITNUM", OPTION_ARG_OPTIONAL, "The bit number for phi"},
    { "im",            10,   "MODE",                   0, "The default interrupt mode"},
    { "debug",        'd',  "LEVEL",                   0, "Sets debug level (0 1 or 2)"},
+   { "memory-model",    OPT_MEMORY_MODEL,    0,                  0,                   "Model memory, and check reads against earlier accesses"},
+   { "memory-map",      OPT_MEMORY_MAP,      "FILE",             0,                   "Model banked memory, as described by FILE (implies --memory-model)"},
+   { "block-bulk",      OPT_BLOCK_BULK,      0,                  0,                   "Emulate each run of a repeating block instruction in bulk, still printing every iteration (not with --state)"},
+   { "block-summary",   OPT_BLOCK_SUMMARY,   0,                  0,                   "Summarise each run of a repeating block instruction on one line"},
+   { "stats",           OPT_STATS,           "FILE",             0,                   "Write per-opcode statistics to FILE (CSV if FILE ends in .csv, otherwise JSON), instead of the disassembly"},
+   { "profile",         OPT_PROFILE,         "FILE",             0,                   "Write a per-address execution profile to FILE"},
+   { "profile-top",     OPT_PROFILE_TOP,     "N",                0,                   "The number of hottest addresses to list in the profile (default 20)"},
+   { "callgrind",       OPT_CALLGRIND,       "FILE",             0,                   "Write the reconstructed call graph to FILE in callgrind format"},
+   { "folded",          OPT_FOLDED,          "FILE",             0,                   "Write the reconstructed call graph to FILE as folded stacks"},
+   { "bus-stats",       OPT_BUS_STATS,       "FILE",             0,                   "Write wait state statistics per memory region and IO port to FILE (CSV if FILE ends in .csv, otherwise JSON)"},
+   { "bus-region",      OPT_BUS_REGION,      "START-END[=NAME]", 0,                   "Add a memory region for --bus-stats (may be repeated; default is 4K regions)"},
+   { "int-stats",       OPT_INT_STATS,       "FILE",             0,                   "Write interrupt rate, latency and service time statistics to FILE (CSV if FILE ends in .csv, otherwise JSON)"},
+   { "stack-stats",     OPT_STACK_STATS,     "FILE",             0,                   "Write the stack high-water marks of the main program and each interrupt handler to FILE (CSV if FILE ends in .csv, otherwise JSON)"},
+   { "coverage",        OPT_COVERAGE,        "FILE",             0,                   "Write fetch/read/write memory and IO port coverage bitmaps to FILE"},
+   { "coverage-report", OPT_COVERAGE_REPORT, "FILE",             0,                   "Write a summary of the memory and IO ports accessed to FILE"},
+   { "dump-memory",     OPT_DUMP_MEMORY,     "FILE",             0,                   "Write the memory image reconstructed from the bus traffic to FILE (see memmerge)"},
+   { "symbols",         OPT_SYMBOLS,         "FILE",             0,                   "Load symbols from FILE (.sym, .map or name = value lists) to label addresses in the disassembly (may be repeated)"},
+   { "collapse-loops",  OPT_COLLAPSE_LOOPS,  0,                  0,                   "Summarise the repetitions of loops (including HALT) on one line"},
+   { "cfg",             OPT_CFG,             "FILE",             0,                   "Write the control flow graph of basic blocks to FILE (DOT if FILE ends in .dot, otherwise JSON)"},
+   { "samplerate",      OPT_SAMPLERATE,      "HZ",               0,                   "The capture sample rate, which may have a k, M or G suffix (e.g. 25M), for --time"},
+   { "metrics",         OPT_METRICS,         "FILE",             0,                   "Write time series metrics per window to FILE (CSV if FILE ends in .csv, otherwise binary)"},
+   { "metrics-window",  OPT_METRICS_WINDOW,  "N",                0,                   "The metrics window length in T-states, or in samples with an s suffix (default 100000)"},
+   { "idle",            OPT_IDLE,            "START-END",        0,                   "Count the T-states executing in an address range as idle in the metrics (may be repeated)"},
+   { "trace",           OPT_TRACE,           "FILE",             0,                   "Write a timeline of functions, interrupts, HALTs and block instructions to FILE in Chrome trace event format"},
+   { "start-sample",    OPT_START_SAMPLE,    "N",                0,                   "Suppress the output before sample N"},
+   { "stop-sample",     OPT_STOP_SAMPLE,     "N",                0,                   "Stop decoding at sample N"},
+   { "start-pc",        OPT_START_PC,        "ADDR[:N]",         0,                   "Suppress the output before the Nth execution (default 1st) of the instruction at ADDR"},
+   { "stop-pc",         OPT_STOP_PC,         "ADDR[:N]",         0,                   "Stop decoding at the Nth execution (default 1st) of the instruction at ADDR"},
+   { "stop-after",      OPT_STOP_AFTER,      "N",                0,                   "Stop decoding after N instructions have been output"},
+   { "stop-on-fail",    OPT_STOP_ON_FAIL,    0,                  0,                   "Stop decoding after the first instruction that fails"},
+   { "filter",          OPT_FILTER,          "EXPR",             0,                   "Only output the instructions that match EXPR, e.g. \"io && !pc=0-0x1fff\" (may be repeated; see filter.c)"},
+   { "flight-recorder", OPT_FLIGHT_RECORDER, "N",                OPTION_ARG_OPTIONAL, "Keep the last N cycles (default 64) and their samples, and only output them when a warning or failure occurs"},
+   { "warn-limit",      OPT_WARN_LIMIT,      "N",                0,                   "Only print the first N of each warning (by message, cycle types and PC) inline"},
+   { "warn-summary",    OPT_WARN_SUMMARY,    0,                  0,                   "Print a table of the warnings at exit"},
+   { "warn-abort",      OPT_WARN_ABORT,      "N",                0,                   "Stop decoding after N warnings, as the capture is unusable"},
+   { "fail-report",     OPT_FAIL_REPORT,     "FILE",             0,                   "Write the emulation failures by opcode and kind, the first occurrences and the state convergence to FILE as JSON"},
+   { "fail-first",      OPT_FAIL_FIRST,      "N",                0,                   "The number of failures recorded individually in the fail report (default 100)"},
 // Output options
    { "address",      'a',        0,                   0, "Show address of instruction."},
    { "hex",          'h',        0,                   0, "Show hex bytes of instruction."},
    { "instruction",  'i',        0,                   0, "Show instruction."},
    { "state",        's',  "LEVEL", OPTION_ARG_OPTIONAL, "Show register/flag state."},
    { "cycles",       'y',        0,                   0, "Show number of bus cycles."},
+   { "time",         't',   "UNIT", OPTION_ARG_OPTIONAL, "Show start time of instruction (in us or ns with --samplerate, otherwise the sample number) and T-states since reset."},
    { "cpu",          'c',    "CPU",                   0, "Enable cpu specific behaviour"},
    { 0 }
 };
@@ -87,11 +192,66 @@ struct arguments {
    int show_instruction;
    int show_state;
    int show_cycles;
+   int show_time;
+   double samplerate;
    int cpu;
    int debug;
    int default_im;
+   int mem_model;
+   char *mem_map;
+   int block_bulk;
+   int block_summary;
+   char *stats;
+   char *profile;
+   int profile_top;
+   char *callgrind;
+   char *folded;
+   char *bus_stats;
+   char *int_stats;
+   char *stack_stats;
+   char *coverage;
+   char *coverage_report;
+   char *dump_memory;
+   int symbols;
+   int collapse_loops;
+   char *cfg;
+   char *metrics;
+   char *trace;
+   uint64_t start_sample;
+   uint64_t stop_sample;
+   int start_pc;
+   int start_pc_count;
+   int stop_pc;
+   int stop_pc_count;
+   uint64_t stop_after;
+   int stop_on_fail;
+   int filter;
+   int flight_recorder;
+   int warn_summary;
+   char *fail_report;
+   int fail_first;
 } arguments;
 
+// Parses a trigger address with an optional execution count (ADDR[:N])
+static int parse_trigger_pc(const char *arg, int *pc, int *count) {
+   char *end;
+   long addr = strtol(arg, &end, 0);
+   long n = 1;
+   if (end == arg || addr < 0 || addr > 0xffff) {
+      return 1;
+   }
+   if (*end == ':') {
+      const char *start = end + 1;
+      n = strtol(start, &end, 0);
+      if (end == start || n < 1) {
+         return 1;
+      }
+   }
+   *pc    = (int) addr;
+   *count = (int) n;
+   return *end != '\0';
+}
+
 static error_t parse_opt(int key, char *arg, struct argp_state *state) {
    int i;
    struct arguments *arguments = state->input;
@@ -158,6 +318,70 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
    case  10:
       arguments->default_im = atoi(arg);
       break;
+   case OPT_MEMORY_MODEL:
+      arguments->mem_model = 1;
+      break;
+   case OPT_MEMORY_MAP:
+      arguments->mem_model = 1;
+      arguments->mem_map = arg;
+      break;
+   case OPT_BLOCK_BULK:
+      arguments->block_bulk = 1;
+      break;
+   case OPT_BLOCK_SUMMARY:
+      arguments->block_bulk = 1;
+      arguments->block_summary = 1;
+      break;
+   case OPT_STATS:
+      arguments->stats = arg;
+      break;
+   case OPT_PROFILE:
+      arguments->profile = arg;
+      break;
+   case OPT_PROFILE_TOP:
+      arguments->profile_top = atoi(arg);
+      break;
+   case OPT_CALLGRIND:
+      arguments->callgrind = arg;
+      break;
+   case OPT_FOLDED:
+      arguments->folded = arg;
+      break;
+   case OPT_BUS_STATS:
+      arguments->bus_stats = arg;
+      break;
+   case OPT_BUS_REGION:
+      if (busstats_add_region(arg)) {
+         argp_error(state, "invalid bus region: %s", arg);
+      }
+      break;
+   case OPT_INT_STATS:
+      arguments->int_stats = arg;
+      break;
+   case OPT_STACK_STATS:
+      arguments->stack_stats = arg;
+      break;
+   case OPT_COVERAGE:
+      arguments->coverage = arg;
+      break;
+   case OPT_COVERAGE_REPORT:
+      arguments->coverage_report = arg;
+      break;
+   case OPT_DUMP_MEMORY:
+      arguments->dump_memory = arg;
+      break;
+   case OPT_SYMBOLS:
+      if (symbols_load(arg)) {
+         argp_failure(state, 2, errno, "%s", arg);
+      }
+      arguments->symbols = 1;
+      break;
+   case OPT_COLLAPSE_LOOPS:
+      arguments->collapse_loops = 1;
+      break;
+   case OPT_CFG:
+      arguments->cfg = arg;
+      break;
    case 'c':
       i = 0;
       while (cpu_names[i]) {
@@ -191,6 +415,120 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
    case 'y':
       arguments->show_cycles = 1;
       break;
+   case 't':
+      if (!arg || !strcmp(arg, "us")) {
+         arguments->show_time = TIME_US;
+      } else if (!strcmp(arg, "ns")) {
+         arguments->show_time = TIME_NS;
+      } else {
+         argp_error(state, "time unit must be us or ns");
+      }
+      break;
+   case OPT_SAMPLERATE:
+      {
+         char *end;
+         arguments->samplerate = strtod(arg, &end);
+         if (*end == 'k' || *end == 'K') {
+            arguments->samplerate *= 1e3;
+            end++;
+         } else if (*end == 'M') {
+            arguments->samplerate *= 1e6;
+            end++;
+         } else if (*end == 'G') {
+            arguments->samplerate *= 1e9;
+            end++;
+         }
+         if (end == arg || *end || arguments->samplerate <= 0) {
+            argp_error(state, "invalid sample rate: %s", arg);
+         }
+      }
+      break;
+   case OPT_METRICS:
+      arguments->metrics = arg;
+      break;
+   case OPT_METRICS_WINDOW:
+      if (metrics_set_window(arg)) {
+         argp_error(state, "invalid metrics window: %s", arg);
+      }
+      break;
+   case OPT_IDLE:
+      if (metrics_add_idle(arg)) {
+         argp_error(state, "invalid idle range: %s", arg);
+      }
+      break;
+   case OPT_TRACE:
+      arguments->trace = arg;
+      break;
+   case OPT_START_SAMPLE:
+   case OPT_STOP_SAMPLE:
+   case OPT_STOP_AFTER:
+      {
+         char *end;
+         uint64_t n = strtoull(arg, &end, 0);
+         if (end == arg || *end) {
+            argp_error(state, "invalid count: %s", arg);
+         }
+         if (key == OPT_START_SAMPLE) {
+            arguments->start_sample = n;
+         } else if (key == OPT_STOP_SAMPLE) {
+            arguments->stop_sample = n;
+         } else {
+            arguments->stop_after = n;
+         }
+      }
+      break;
+   case OPT_START_PC:
+      if (parse_trigger_pc(arg, &arguments->start_pc, &arguments->start_pc_count)) {
+         argp_error(state, "invalid start address: %s", arg);
+      }
+      break;
+   case OPT_STOP_PC:
+      if (parse_trigger_pc(arg, &arguments->stop_pc, &arguments->stop_pc_count)) {
+         argp_error(state, "invalid stop address: %s", arg);
+      }
+      break;
+   case OPT_STOP_ON_FAIL:
+      arguments->stop_on_fail = 1;
+      break;
+   case OPT_FILTER:
+      {
+         const char *error;
+         if (filter_compile(arg, &error)) {
+            argp_error(state, "invalid filter expression at: %s", *error ? error : "end");
+         }
+         arguments->filter = 1;
+      }
+      break;
+   case OPT_FLIGHT_RECORDER:
+      arguments->flight_recorder = arg ? atoi(arg) : 64;
+      if (arguments->flight_recorder <= 0 || arguments->flight_recorder > FLIGHT_MAX_CYCLES) {
+         argp_error(state, "invalid flight recorder size (at most %d cycles): %s", FLIGHT_MAX_CYCLES, arg);
+      }
+      break;
+   case OPT_WARN_LIMIT:
+      if (atoi(arg) <= 0) {
+         argp_error(state, "invalid warning limit: %s", arg);
+      }
+      warnings_set_limit(atoi(arg));
+      break;
+   case OPT_WARN_SUMMARY:
+      arguments->warn_summary = 1;
+      break;
+   case OPT_WARN_ABORT:
+      if (strtoull(arg, NULL, 0) == 0) {
+         argp_error(state, "invalid warning threshold: %s", arg);
+      }
+      warnings_set_abort(strtoull(arg, NULL, 0));
+      break;
+   case OPT_FAIL_REPORT:
+      arguments->fail_report = arg;
+      break;
+   case OPT_FAIL_FIRST:
+      arguments->fail_first = atoi(arg);
+      if (arguments->fail_first < 0) {
+         argp_error(state, "invalid number of failures: %s", arg);
+      }
+      break;
    case ARGP_KEY_ARG:
       arguments->filename = arg;
       break;
@@ -198,6 +536,13 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
       if (state->arg_num > 1) {
          argp_error(state, "multiple capture file arguments");
       }
+      if (arguments->block_bulk && !arguments->block_summary && arguments->show_state) {
+         // The state is only known at the end of each run
+         argp_error(state, "--block-bulk cannot be used with --state");
+      }
+      if (arguments->filter && arguments->collapse_loops) {
+         argp_error(state, "--filter cannot be used with --collapse-loops");
+      }
       break;
    default:
       return ARGP_ERR_UNKNOWN;
@@ -274,7 +619,8 @@ typedef struct {
    int num_samples;
    int instr_cycles;
    int wait_cycles;
-   int sample_index;
+   int sample_index;   // of the first sample, in the sample buffer
+   uint64_t sample_num; // of the first sample, from the start of the capture
 } Z80CycleSummaryType;
 
 
@@ -285,8 +631,9 @@ int arg_imm            = 0;
 int arg_read           = 0;
 int arg_write          = 0;
 int failflag           = FAIL_NONE;
+static int taken       = True;
 int instr_len          = 0;
-InstrType *instruction = NULL;
+const InstrType *instruction = NULL;
 
 static int instr_bytes[MAX_INSTR_LEN];
 static AnnType ann_dasm     = ANN_NONE;
@@ -294,8 +641,90 @@ static const char *mnemonic = NULL;
 static FormatType format    = TYPE_0;
 static char *arg_reg        = NULL;
 
+// The message of a decoder warning, which takes the cycle name
+static const char *warning_format = NULL;
+static const char *warning_cycle  = NULL;
+
+// The number of the first sample of the instruction, and the T-states
+// from reset to the start of the instruction
+static uint64_t instr_sample = 0;
+static uint64_t instr_tstate = 0;
+
 static Z80StateType state;
 
+// A copy of the decoded instruction, so it can be processed later
+typedef struct {
+   int prefix;
+   int opcode;
+   int arg_dis;
+   int arg_imm;
+   int arg_read;
+   int arg_write;
+   int taken;
+   int instr_len;
+   int instr_bytes[MAX_INSTR_LEN];
+   const InstrType *instruction;
+   const char *mnemonic;
+   FormatType format;
+   char *arg_reg;
+   uint64_t instr_sample;
+   uint64_t instr_tstate;
+} InstrContextType;
+
+static void save_context(InstrContextType *context) {
+   context->prefix      = prefix;
+   context->opcode      = opcode;
+   context->arg_dis     = arg_dis;
+   context->arg_imm     = arg_imm;
+   context->arg_read    = arg_read;
+   context->arg_write   = arg_write;
+   context->taken       = taken;
+   context->instr_len   = instr_len;
+   context->instruction = instruction;
+   context->mnemonic    = mnemonic;
+   context->format      = format;
+   context->arg_reg     = arg_reg;
+   context->instr_sample = instr_sample;
+   context->instr_tstate = instr_tstate;
+   memcpy(context->instr_bytes, instr_bytes, sizeof(instr_bytes));
+}
+
+static void restore_context(InstrContextType *context) {
+   prefix      = context->prefix;
+   opcode      = context->opcode;
+   arg_dis     = context->arg_dis;
+   arg_imm     = context->arg_imm;
+   arg_read    = context->arg_read;
+   arg_write   = context->arg_write;
+   taken       = context->taken;
+   instr_len   = context->instr_len;
+   instruction = context->instruction;
+   mnemonic    = context->mnemonic;
+   format      = context->format;
+   arg_reg     = context->arg_reg;
+   instr_sample = context->instr_sample;
+   instr_tstate = context->instr_tstate;
+   memcpy(instr_bytes, context->instr_bytes, sizeof(instr_bytes));
+}
+
+// The bus cycles of the current instruction, for --bus-stats
+
+#define MAX_BUS_CYCLES 16
+
+typedef struct {
+   Z80CycleType cycle;
+   int code;
+   int wait_cycles;
+} BusCycleType;
+
+static BusCycleType bus_cycles[MAX_BUS_CYCLES];
+
+static int num_bus_cycles = 0;
+
+// The bus cycle types (as a bit mask) of the operand reads and writes of the
+// current instruction, but not its instruction bytes, for --filter
+static int instr_cycle_types = 0;
+
 // Indicates the data bus value was not processed, and needs
 // to be re-presented
 #define BIT_UNPROCESSED 1
@@ -311,7 +740,6 @@ int decode_instruction(Z80CycleSummaryType *cycle_q) {
    static int want_write  = 0;
    static int want_wr_be  = False;
    static int conditional = False;
-   static char warning_buffer[80];
 
    int cycle  = cycle_q->cycle;
    int data   = cycle_q->data;
@@ -332,6 +760,7 @@ int decode_instruction(Z80CycleSummaryType *cycle_q) {
       arg_imm     = 0;
       arg_read    = 0;
       arg_write   = 0;
+      taken       = True;
       arg_reg     = "";
       mnemonic    = "";
       format      = TYPE_0;
@@ -345,8 +774,8 @@ int decode_instruction(Z80CycleSummaryType *cycle_q) {
    case S_OPCODE:
       // Check the cycle type...
       if (cycle != C_INTACK && cycle != ((prefix == 0xDDCB || prefix == 0xFDCB) ? C_MEMRD : C_FETCH)) {
-         sprintf(warning_buffer, "Incorrect cycle type for prefix/opcode: %s", cycle_names[cycle]);
-         mnemonic = warning_buffer;
+         warning_format = "Incorrect cycle type for prefix/opcode: %s";
+         warning_cycle  = cycle_names[cycle];
          ann_dasm = ANN_WARN;
          state = S_IDLE;
          break;
@@ -400,7 +829,7 @@ int decode_instruction(Z80CycleSummaryType *cycle_q) {
          break;
       } else {
          // Decode the prefix/opcode normally
-         InstrType *table = table_by_prefix(prefix);
+         const InstrType *table = table_by_prefix(prefix);
          arg_reg = reg_by_prefix(prefix);
          opcode = data;
          instr_bytes[instr_len++] = data;
@@ -412,7 +841,7 @@ int decode_instruction(Z80CycleSummaryType *cycle_q) {
       }
       // Undefined opcodes in blocks 0xDD and 0xFD act like the unprefixed opcode
       if ((prefix == 0xDD || prefix == 0xFD) && (instruction->want_dis < 0)) {
-         InstrType *table = table_by_prefix(0);
+         const InstrType *table = table_by_prefix(0);
          instruction = &table[opcode];
       }
       // If we get this far without hitting a break, we are ready to execute an instruction
@@ -423,7 +852,6 @@ int decode_instruction(Z80CycleSummaryType *cycle_q) {
       conditional = instruction->conditional;
       format      = instruction->format;
       mnemonic    = instruction->mnemonic;
-      instruction->count++;
       if (want_write < 0) {
          want_wr_be = True;
          want_write = -want_write;
@@ -449,8 +877,8 @@ int decode_instruction(Z80CycleSummaryType *cycle_q) {
 
    case S_PREDIS:
       if (cycle != C_MEMRD) {
-         sprintf(warning_buffer, "Incorrect cycle type for pre-displacement: %s", cycle_names[cycle]);
-         mnemonic = warning_buffer;
+         warning_format = "Incorrect cycle type for pre-displacement: %s";
+         warning_cycle  = cycle_names[cycle];
          ann_dasm = ANN_WARN;
          state = S_IDLE;
          ret |= BIT_UNPROCESSED;
@@ -463,8 +891,8 @@ int decode_instruction(Z80CycleSummaryType *cycle_q) {
 
    case S_POSTDIS:
       if (cycle != C_MEMRD) {
-         sprintf(warning_buffer, "Incorrect cycle type for post displacement: %s", cycle_names[cycle]);
-         mnemonic = warning_buffer;
+         warning_format = "Incorrect cycle type for post displacement: %s";
+         warning_cycle  = cycle_names[cycle];
          ann_dasm = ANN_WARN;
          state = S_IDLE;
          ret |= BIT_UNPROCESSED;
@@ -489,8 +917,8 @@ int decode_instruction(Z80CycleSummaryType *cycle_q) {
 
    case S_IMM1:
       if (cycle != C_MEMRD) {
-         sprintf(warning_buffer, "Incorrect cycle type for immediate1: %s", cycle_names[cycle]);
-         mnemonic = warning_buffer;
+         warning_format = "Incorrect cycle type for immediate1: %s";
+         warning_cycle  = cycle_names[cycle];
          ann_dasm = ANN_WARN;
          state = S_IDLE;
          ret |= BIT_UNPROCESSED;
@@ -515,8 +943,8 @@ int decode_instruction(Z80CycleSummaryType *cycle_q) {
 
    case S_IMM2:
       if (cycle != C_MEMRD) {
-         sprintf(warning_buffer, "Incorrect cycle type for immediate2: %s", cycle_names[cycle]);
-         mnemonic = warning_buffer;
+         warning_format = "Incorrect cycle type for immediate2: %s";
+         warning_cycle  = cycle_names[cycle];
          ann_dasm = ANN_WARN;
          state = S_IDLE;
          ret |= BIT_UNPROCESSED;
@@ -540,13 +968,14 @@ int decode_instruction(Z80CycleSummaryType *cycle_q) {
       // we might not see any memory accesses, and the next thing
       // will be the fetch of the next instruction
       if (conditional && (cycle == C_FETCH || cycle == C_INTACK)) {
+         taken = False;
          state = S_IDLE;
          ret |= BIT_INSTRUCTION | BIT_UNPROCESSED;
          break;
       }
       if (cycle != C_MEMRD && cycle != C_IORD) {
-         sprintf(warning_buffer, "Incorrect cycle type for read op1: %s", cycle_names[cycle]);
-         mnemonic = warning_buffer;
+         warning_format = "Incorrect cycle type for read op1: %s";
+         warning_cycle  = cycle_names[cycle];
          ann_dasm = ANN_WARN;
          state = S_IDLE;
          ret |= BIT_UNPROCESSED;
@@ -575,8 +1004,8 @@ int decode_instruction(Z80CycleSummaryType *cycle_q) {
 
    case S_ROP2:
       if (cycle != C_MEMRD && cycle != C_IORD) {
-         sprintf(warning_buffer, "Incorrect cycle type for read op2: %s", cycle_names[cycle]);
-         mnemonic = warning_buffer;
+         warning_format = "Incorrect cycle type for read op2: %s";
+         warning_cycle  = cycle_names[cycle];
          ann_dasm = ANN_WARN;
          state = S_IDLE;
          ret |= BIT_UNPROCESSED;
@@ -601,13 +1030,14 @@ int decode_instruction(Z80CycleSummaryType *cycle_q) {
       // we might not see any memory accesses, and the next thing
       // will be the fetch of the next instruction
       if (conditional && (cycle == C_FETCH || cycle == C_INTACK)) {
+         taken = False;
          state = S_IDLE;
          ret |= BIT_INSTRUCTION | BIT_UNPROCESSED;
          break;
       }
       if (cycle != C_MEMWR && cycle != C_IOWR) {
-         sprintf(warning_buffer, "Incorrect cycle type for write op1: %s", cycle_names[cycle]);
-         mnemonic = warning_buffer;
+         warning_format = "Incorrect cycle type for write op1: %s";
+         warning_cycle  = cycle_names[cycle];
          ann_dasm = ANN_WARN;
          state = S_IDLE;
          ret |= BIT_UNPROCESSED;
@@ -631,8 +1061,8 @@ int decode_instruction(Z80CycleSummaryType *cycle_q) {
 
    case S_WOP2:
       if (cycle != C_MEMWR && cycle != C_IOWR) {
-         sprintf(warning_buffer, "Incorrect cycle type for write op2: %s", cycle_names[cycle]);
-         mnemonic = warning_buffer;
+         warning_format = "Incorrect cycle type for write op2: %s";
+         warning_cycle  = cycle_names[cycle];
          ann_dasm = ANN_WARN;
          state = S_IDLE;
          ret |= BIT_UNPROCESSED;
@@ -692,26 +1122,1116 @@ Z80CycleType get_cycle_type(uint16_t sample) {
 }
 
 
+// ====================================================================
+// Instruction output
+// ====================================================================
+
+// Formats the disassembled instruction with a label in place of its 16-bit
+// immediate value, returning the number of characters
+static int format_mnemonic_label(char *buffer, int size, const char *label) {
+   char fmt[32];
+   const char *imm = strstr(mnemonic, "%04Xh");
+   snprintf(fmt, sizeof(fmt), "%.*s%%s%s", (int) (imm - mnemonic), mnemonic, imm + 5);
+   switch (format) {
+   case TYPE_3:
+      return snprintf(buffer, size, fmt, label, arg_reg);
+   case TYPE_4:
+      return snprintf(buffer, size, fmt, arg_reg, label);
+   default:
+      return snprintf(buffer, size, fmt, label);
+   }
+}
+
+// Whether the 16-bit immediate value of the instruction is an address: a
+// JP or CALL target, or a (nn) memory operand, rather than a constant
+static int immediate_is_address() {
+   return instruction->want_imm == 2 &&
+      (!strncmp(mnemonic, "JP ", 3) || !strncmp(mnemonic, "CALL ", 5) || strstr(mnemonic, "(%04Xh)"));
+}
+
+// Formats the disassembled instruction, returning the number of characters
+static int format_mnemonic(char *buffer, int size, int pc) {
+   char target[10];
+   const char *label;
+   if (arguments.symbols && immediate_is_address() && (label = symbols_lookup(arg_imm))) {
+      return format_mnemonic_label(buffer, size, label);
+   }
+   switch (format) {
+   case TYPE_1:
+      return snprintf(buffer, size, mnemonic, arg_reg);
+   case TYPE_2:
+      return snprintf(buffer, size, mnemonic, arg_reg, arg_reg);
+   case TYPE_3:
+      return snprintf(buffer, size, mnemonic, arg_imm, arg_reg);
+   case TYPE_4:
+      return snprintf(buffer, size, mnemonic, arg_reg, arg_imm);
+   case TYPE_5:
+      return snprintf(buffer, size, mnemonic, arg_reg, arg_dis);
+   case TYPE_6:
+      return snprintf(buffer, size, mnemonic, arg_reg, arg_dis, arg_imm);
+   case TYPE_7:
+      if (pc >= 0 && arguments.symbols && (label = symbols_lookup(pc + instr_len + arg_dis))) {
+         return snprintf(buffer, size, mnemonic, label);
+      } else if (pc >= 0) {
+         sprintf(target, "%04Xh", (pc + instr_len + arg_dis) & 0xffff);
+      } else {
+         sprintf(target, "$%+d", arg_dis + instr_len);
+      }
+      return snprintf(buffer, size, mnemonic, target);
+   case TYPE_8:
+      return snprintf(buffer, size, mnemonic, arg_imm);
+   default:
+      return snprintf(buffer, size, mnemonic, 0);
+   }
+}
+
+// Appends to the text being formatted, stopping at the end of the buffer
+#define APPEND(...) \
+   len += snprintf(buffer + len, len < size ? size - len : 0, __VA_ARGS__)
+
+// Formats the address, hex bytes and instruction fields of the instruction
+// at pc, returning the number of characters (which may be more than would
+// fit). A non-zero repeat is shown after the instruction, for a summarised
+// block run.
+static int format_instruction(char *buffer, int size, int pc, int repeat) {
+   int len = 0;
+   int colon = 0;
+   buffer[0] = '\0';
+   if (arguments.show_address) {
+      if (pc >= 0) {
+         APPEND("%04X", pc);
+      } else {
+         APPEND("????");
+      }
+      colon = 1;
+   }
+   if (arguments.show_hex) {
+      if (colon) {
+         APPEND(" : ");
+      }
+      for (int i = 0; i < MAX_INSTR_LEN; i++) {
+         if (i < instr_len) {
+            APPEND("%02X ", instr_bytes[i]);
+         } else {
+            APPEND("   ");
+         }
+      }
+      colon = 1;
+   }
+   if (arguments.show_instruction) {
+      if (colon) {
+         APPEND(" : ");
+      }
+      int start = len;
+      len += format_mnemonic(buffer + len, len < size ? size - len : 0, pc);
+      if (repeat) {
+         APPEND(" x%d", repeat);
+      }
+      // Pad the disassembled instruction
+      if (arguments.show_cycles || arguments.show_state) {
+         while (len - start < 20) {
+            APPEND(" ");
+         }
+      }
+   }
+   return len;
+}
+
+// The formatted text of recently printed instructions, indexed by the PC
+// (or by a hash of the instruction bytes when the PC is unknown). An entry
+// is only used if the instruction bytes match, so code that has since been
+// modified is formatted again.
+
+#define DISASM_TEXT_SIZE 96
+
+typedef struct {
+   const InstrType *instruction;
+   int pc;
+   int instr_len;
+   uint64_t bytes;
+   int len;
+   char text[DISASM_TEXT_SIZE];
+} DisasmCacheEntryType;
+
+static DisasmCacheEntryType *disasm_cache = NULL;
+
+// Returns the formatted fields of the current instruction, using the cache
+// where possible, and sets *len to the length of the text
+static const char *cached_instruction(char *buffer, int size, int pc, int *len) {
+   uint64_t bytes = 0;
+   for (int i = 0; i < instr_len; i++) {
+      bytes = (bytes << 8) | instr_bytes[i];
+   }
+   int index = pc >= 0 ? pc : (bytes ^ (bytes >> 16) ^ (bytes >> 32) ^ (instr_len << 8)) & 0xffff;
+   DisasmCacheEntryType *entry = &disasm_cache[index];
+   if (entry->instruction == instruction && entry->pc == pc && entry->instr_len == instr_len && entry->bytes == bytes) {
+      *len = entry->len;
+      return entry->text;
+   }
+   *len = format_instruction(buffer, size, pc, 0);
+   if (*len < DISASM_TEXT_SIZE) {
+      entry->instruction = instruction;
+      entry->pc          = pc;
+      entry->instr_len   = instr_len;
+      entry->bytes       = bytes;
+      entry->len         = *len;
+      memcpy(entry->text, buffer, *len);
+   }
+   return buffer;
+}
+
+// Prints the time, address, hex bytes, instruction and cycle fields of the
+// instruction at pc (after any label), returning whether anything was
+// printed. A non-zero repeat is shown after the instruction, for a
+// summarised block run.
+static int print_instruction(int pc, int repeat, int instr_cycles, int wait_cycles) {
+   char buffer[256];
+   const char *text = buffer;
+   const char *label;
+   int len;
+   int colon = arguments.show_address || arguments.show_hex || arguments.show_instruction;
+   // The label is only useful above an address, hex bytes or instruction
+   if (colon && arguments.symbols && pc >= 0 && (label = symbols_lookup(pc))) {
+      printf("%s:\n", label);
+   }
+   if (arguments.show_time) {
+      if (arguments.samplerate <= 0) {
+         printf("%12" PRIu64, instr_sample);
+      } else if (arguments.show_time == TIME_NS) {
+         printf("%14.0fns", instr_sample * 1e9 / arguments.samplerate);
+      } else {
+         printf("%14.3fus", instr_sample * 1e6 / arguments.samplerate);
+      }
+      printf(" %12" PRIu64, instr_tstate);
+      if (colon) {
+         printf(" : ");
+      }
+      colon = 1;
+   }
+   if (disasm_cache && !repeat) {
+      text = cached_instruction(buffer, sizeof(buffer), pc, &len);
+   } else {
+      len = format_instruction(buffer, sizeof(buffer), pc, repeat);
+   }
+   if (len >= sizeof(buffer) && text == buffer) {
+      // Too long for the buffer (e.g. a very long label)
+      char *large = malloc(len + 1);
+      if (large) {
+         format_instruction(large, len + 1, pc, repeat);
+         fwrite(large, 1, len, stdout);
+         free(large);
+      }
+   } else {
+      fwrite(text, 1, len, stdout);
+   }
+   if (arguments.show_cycles) {
+      if (colon) {
+         printf(" : ");
+      }
+      printf("%2d/%2d", instr_cycles, wait_cycles);
+      colon = 1;
+   }
+   return colon;
+}
+
+static void end_line(int colon) {
+   if (colon) {
+      printf("\n");
+      if (arguments.debug > 0) {
+         printf("\n");
+      }
+   }
+}
+
+// Prints the state and any failures after the instruction has been emulated,
+// and terminates the line
+static void print_state(int colon) {
+   if (arguments.show_state || failflag) {
+      if (colon) {
+         printf(" : ");
+      }
+      // Show the state after executing this instruction
+      printf("%s", z80_get_state(arguments.show_state));
+      if (failflag > FAIL_NONE) {
+         if (failflag & FAIL_ERROR) {
+            printf(" : fail");
+         }
+         if (failflag & FAIL_MEMORY) {
+            printf(" : ");
+            z80_dump_mem_log();
+            // printf(" : memory modelling");
+         }
+         if (failflag & FAIL_NOT_IMPLEMENTED) {
+            printf(" : not implemented");
+         }
+         if (failflag & FAIL_IMPLEMENTATION_ERROR) {
+            printf(" : implementation error");
+         }
+      }
+      colon = 1;
+   }
+   end_line(colon);
+}
+
+// ====================================================================
+// Loop collapsing
+// ====================================================================
+
+// When an instruction repeats one seen recently, the instructions that
+// follow are held back while they repeat the same sequence (by PC and
+// instruction bytes, and cycle count so that a different branch breaks
+// the sequence). Each complete repetition of the loop body is
+// discarded, and when the sequence is broken the repetitions are replaced
+// by one summary line and any partial repetition is printed normally.
+// Repeated HALT-NOPs are simply a loop of length one.
+
+#define MAX_LOOP_BODY 256
+#define LOOP_HISTORY  1024
+
+typedef struct {
+   int pc;     // -1 for an instruction that can't be part of a loop
+   int cycles; // excluding wait states
+   int instr_len;
+   int instr_bytes[MAX_INSTR_LEN];
+} LoopKeyType;
+
+typedef struct {
+   InstrContextType context;
+   int pc;
+   int instr_cycles;
+   int wait_cycles;
+   char state[128];
+} LoopEntryType;
+
+static struct {
+   // The number of the next instruction, and the keys of the last few
+   uint64_t seq;
+   LoopKeyType history[LOOP_HISTORY];
+   // The number (plus one) of the last instruction seen at each address
+   uint64_t last_seen[0x10000];
+   // The length of the loop body, or zero if not in a loop
+   int period;
+   int iterations;
+   int64_t total_cycles;
+   int64_t total_wait;
+   // The instructions of the current partial repetition
+   int num_held;
+   int held_cycles;
+   int held_wait;
+   LoopEntryType held[MAX_LOOP_BODY];
+} loop;
+
+static int same_key(const LoopKeyType *a, const LoopKeyType *b) {
+   if (a->pc < 0 || a->pc != b->pc || a->cycles != b->cycles || a->instr_len != b->instr_len) {
+      return 0;
+   }
+   for (int i = 0; i < a->instr_len; i++) {
+      if (a->instr_bytes[i] != b->instr_bytes[i]) {
+         return 0;
+      }
+   }
+   return 1;
+}
+
+// Prints the summary of the collapsed repetitions, and any held instructions
+static void end_loop() {
+   if (!loop.period) {
+      return;
+   }
+   if (loop.iterations) {
+      printf("LOOP: %d instruction%s repeated %d time%s : %"PRId64"/%"PRId64"\n",
+             loop.period, loop.period == 1 ? "" : "s",
+             loop.iterations, loop.iterations == 1 ? "" : "s",
+             loop.total_cycles, loop.total_wait);
+   }
+   InstrContextType current;
+   save_context(&current);
+   for (int i = 0; i < loop.num_held; i++) {
+      LoopEntryType *entry = &loop.held[i];
+      restore_context(&entry->context);
+      int colon = print_instruction(entry->pc, 0, entry->instr_cycles, entry->wait_cycles);
+      if (arguments.show_state) {
+         printf("%s%s", colon ? " : " : "", entry->state);
+         colon = 1;
+      }
+      end_line(colon);
+   }
+   restore_context(&current);
+   loop.period     = 0;
+   loop.num_held   = 0;
+}
+
+// Ends any loop, and stops the next instruction being matched against the
+// ones before (e.g. after a warning or a block run)
+static void break_loop() {
+   end_loop();
+   loop.history[loop.seq++ % LOOP_HISTORY].pc = -1;
+}
+
+// Called before the current instruction (at pc) is emulated, returning
+// whether it is held back as a possible repetition of a loop
+static int hold_loop_instruction(int pc, int instr_cycles, int wait_cycles) {
+   LoopKeyType *key = &loop.history[loop.seq % LOOP_HISTORY];
+   key->pc = (instruction == &z80_interrupt_int || instruction == &z80_interrupt_nmi) ? -1 : pc;
+   key->cycles = instr_cycles - wait_cycles;
+   key->instr_len = instr_len;
+   memcpy(key->instr_bytes, instr_bytes, sizeof(instr_bytes));
+   if (loop.period && !same_key(key, &loop.history[(loop.seq - loop.period) % LOOP_HISTORY])) {
+      end_loop();
+   }
+   if (!loop.period && key->pc >= 0) {
+      // Look for the start of a repetition
+      uint64_t last = loop.last_seen[key->pc];
+      if (last && loop.seq - (last - 1) <= MAX_LOOP_BODY &&
+          same_key(key, &loop.history[(last - 1) % LOOP_HISTORY])) {
+         loop.period       = loop.seq - (last - 1);
+         loop.iterations   = 0;
+         loop.total_cycles = 0;
+         loop.total_wait   = 0;
+         loop.num_held     = 0;
+         loop.held_cycles  = 0;
+         loop.held_wait    = 0;
+      }
+   }
+   if (key->pc >= 0) {
+      loop.last_seen[key->pc] = loop.seq + 1;
+   }
+   loop.seq++;
+   if (!loop.period) {
+      return 0;
+   }
+   LoopEntryType *entry = &loop.held[loop.num_held++];
+   save_context(&entry->context);
+   entry->pc           = pc;
+   entry->instr_cycles = instr_cycles;
+   entry->wait_cycles  = wait_cycles;
+   loop.held_cycles   += instr_cycles;
+   loop.held_wait     += wait_cycles;
+   return 1;
+}
+
+// Called after a held instruction has been emulated. A failure ends the
+// loop, and the instruction is printed normally.
+static void held_loop_instruction_done(int pc, int instr_cycles, int wait_cycles) {
+   if (failflag) {
+      loop.num_held--;
+      end_loop();
+      print_state(print_instruction(pc, 0, instr_cycles, wait_cycles));
+      return;
+   }
+   if (arguments.show_state) {
+      LoopEntryType *entry = &loop.held[loop.num_held - 1];
+      snprintf(entry->state, sizeof(entry->state), "%s", z80_get_state(arguments.show_state));
+   }
+   if (loop.num_held == loop.period) {
+      // A complete repetition of the loop body
+      loop.iterations++;
+      loop.total_cycles += loop.held_cycles;
+      loop.total_wait   += loop.held_wait;
+      loop.num_held      = 0;
+      loop.held_cycles   = 0;
+      loop.held_wait     = 0;
+   }
+}
+
+// ====================================================================
+// Start/stop triggers
+// ====================================================================
+
+// Before the start trigger instructions are only emulated, to keep the state
+// up to date. Once a stop trigger fires, the rest of the capture is ignored.
+static struct {
+   int started;
+   int stopped;
+   uint64_t instructions;
+} trigger;
+
+// Counts an execution of the instruction at pc towards an ADDR:N trigger,
+// returning non-zero on the Nth execution. INT and NMI carry the PC of the
+// interrupted instruction, so are not counted.
+static int trigger_pc_reached(int pc, int trigger_pc, int *count) {
+   if (instruction == &z80_interrupt_int || instruction == &z80_interrupt_nmi) {
+      return 0;
+   }
+   return *count && pc == trigger_pc && --*count == 0;
+}
+
+// Called at the start of each instruction (which started at sample), returning
+// non-zero if it should be output
+static int trigger_instruction(uint64_t sample) {
+   int pc = z80_get_pc();
+   if (sample >= arguments.stop_sample ||
+       trigger_pc_reached(pc, arguments.stop_pc, &arguments.stop_pc_count) ||
+       (arguments.stop_after && trigger.instructions == arguments.stop_after)) {
+      trigger.stopped = 1;
+      return 0;
+   }
+   if (!trigger.started) {
+      trigger_pc_reached(pc, arguments.start_pc, &arguments.start_pc_count);
+      trigger.started = !arguments.start_pc_count && sample >= arguments.start_sample;
+      if (!trigger.started) {
+         return 0;
+      }
+   }
+   // With a filter, only the instructions that match are counted
+   if (!arguments.filter || arguments.stats) {
+      trigger.instructions++;
+   }
+   return 1;
+}
+
+// ====================================================================
+// Flight recorder
+// ====================================================================
+
+// The recent cycles, with their raw samples, and the recent instructions
+// are kept in rings, and only output when a warning or failure occurs. The
+// dump is deferred by a few cycles so it includes the cycles that follow.
+
+// Longer cycles (e.g. while the bus is idle) are truncated, and the raw
+// sample ring is sized so that it can't wrap before the cycle ring does
+#define FLIGHT_MAX_CYCLE_SAMPLES 256
+
+// The number of cycles recorded after the trigger
+#define FLIGHT_POST_CYCLES (DEPTH + 1)
+
+typedef struct {
+   Z80CycleSummaryType summary; // with sample_index in the flight recorder ring
+   int recorded;                // the number of samples recorded
+   uint64_t seq;                // the instruction the cycle belongs to
+} FlightCycleType;
+
+typedef struct {
+   InstrContextType context;
+   int pc;
+   uint64_t seq;
+} FlightInstrType;
+
+static struct {
+   int size;
+   FlightCycleType *cycles;
+   FlightInstrType *instrs;
+   uint16_t *samples;
+   int sample_mask;
+   int sample_index;
+   uint64_t num_cycles;
+   uint64_t seq;
+   uint64_t dumped;        // the number of cycles already output
+   int pending;            // cycles to record before the pending dump
+   char reason[256];
+} flight;
+
+// Prints n raw samples from a ring (of size mask + 1), without a newline
+// after the last
+static void print_samples(const uint16_t *ring, int mask, int index, int n, int m_cycle) {
+   for (int i = 0; i < n; i++) {
+      uint16_t sample = ring[(index + i) & mask];
+      Z80CycleType cycle = get_cycle_type(sample);
+      int m1   = (sample >> arguments.idx_m1  ) & 1;
+      int rd   = (sample >> arguments.idx_rd  ) & 1;
+      int wr   = (sample >> arguments.idx_wr  ) & 1;
+      int mreq = (sample >> arguments.idx_mreq) & 1;
+      int iorq = (sample >> arguments.idx_iorq) & 1;
+      int wait = (sample >> arguments.idx_wait) & 1;
+      int rst  = (sample >> arguments.idx_rst ) & 1;
+      int phi  = (sample >> arguments.idx_phi ) & 1;
+      int data = (sample >> arguments.idx_data) & 255;
+      printf("M%d %6s %d %d %d %d %d %d %d %d %02x ",
+             m_cycle, cycle_names[cycle],
+             m1, rd, wr, mreq, iorq, wait, rst, phi, data);
+      if (i < n - 1) {
+         printf("\n");
+      }
+   }
+}
+
+static int flight_init(int size) {
+   int num_samples = 1;
+   while (num_samples < size * FLIGHT_MAX_CYCLE_SAMPLES) {
+      num_samples <<= 1;
+   }
+   flight.size        = size;
+   flight.cycles      = calloc(size, sizeof(FlightCycleType));
+   flight.instrs      = calloc(size, sizeof(FlightInstrType));
+   flight.samples     = malloc(num_samples * sizeof(uint16_t));
+   flight.sample_mask = num_samples - 1;
+   if (!flight.cycles || !flight.instrs || !flight.samples) {
+      perror("failed to allocate flight recorder");
+      return 1;
+   }
+   // No instruction has been recorded yet
+   for (int i = 0; i < size; i++) {
+      flight.instrs[i].seq = UINT64_MAX;
+   }
+   return 0;
+}
+
+static void flight_dump() {
+   InstrContextType current;
+   char buffer[256];
+   uint64_t first = flight.num_cycles > flight.size ? flight.num_cycles - flight.size : 0;
+   if (first < flight.dumped) {
+      first = flight.dumped;
+   }
+   printf("FLIGHT RECORDER: %s\n", flight.reason);
+   save_context(&current);
+   int m_cycle = 0;
+   for (uint64_t i = first; i < flight.num_cycles; i++) {
+      FlightCycleType *cycle = &flight.cycles[i % flight.size];
+      m_cycle = cycle->summary.cycle == C_FETCH ? 1 : m_cycle + 1;
+      for (int j = 0; j < cycle->recorded; j++) {
+         printf("%12" PRIu64 " ", cycle->summary.sample_num + j);
+         print_samples(flight.samples, flight.sample_mask, cycle->summary.sample_index + j, 1, m_cycle);
+         printf("\n");
+      }
+      if (cycle->recorded < cycle->summary.num_samples) {
+         printf("%12s ... %d more samples\n", "", cycle->summary.num_samples - cycle->recorded);
+      }
+      // Follow the last cycle of each instruction with its disassembly
+      FlightInstrType *instr = &flight.instrs[cycle->seq % flight.size];
+      int last = i + 1 == flight.num_cycles || flight.cycles[(i + 1) % flight.size].seq != cycle->seq;
+      if (last && instr->seq == cycle->seq) {
+         restore_context(&instr->context);
+         format_instruction(buffer, sizeof(buffer), instr->pc, 0);
+         printf("%12" PRIu64 " %s\n", instr_sample, buffer);
+      }
+   }
+   restore_context(&current);
+   printf("FLIGHT RECORDER: end\n");
+   flight.dumped  = flight.num_cycles;
+   flight.pending = 0;
+}
+
+// Requests a dump of the recent history, once a few more cycles have been
+// recorded
+static void flight_trigger(const char *reason) {
+   if (!flight.pending && trigger.started) {
+      snprintf(flight.reason, sizeof(flight.reason), "%s", reason);
+      flight.pending = FLIGHT_POST_CYCLES;
+   }
+}
+
+static void flight_record_cycle(const Z80CycleSummaryType *summary) {
+   FlightCycleType *cycle = &flight.cycles[flight.num_cycles++ % flight.size];
+   int n = summary->num_samples < FLIGHT_MAX_CYCLE_SAMPLES ? summary->num_samples : FLIGHT_MAX_CYCLE_SAMPLES;
+   cycle->summary = *summary;
+   cycle->summary.sample_index = flight.sample_index;
+   cycle->recorded = n;
+   cycle->seq      = flight.seq;
+   for (int i = 0; i < n; i++) {
+      flight.samples[flight.sample_index] = sample_buffer[(summary->sample_index + i) & (SAMPLE_BUFSIZE - 1)];
+      flight.sample_index = (flight.sample_index + 1) & flight.sample_mask;
+   }
+   if (flight.pending && --flight.pending == 0) {
+      flight_dump();
+   }
+}
+
+static void flight_record_instruction(int pc) {
+   FlightInstrType *instr = &flight.instrs[flight.seq % flight.size];
+   save_context(&instr->context);
+   instr->pc  = pc;
+   instr->seq = flight.seq++;
+}
+
+// ====================================================================
+// Warnings
+// ====================================================================
+
+// Counts a warning (whose format takes the cycle names), and prints it
+// unless its inline limit has been reached
+static void report_warning(const char *format, const char *cycle, const char *next_cycle, uint64_t sample) {
+   char text[128];
+   if (!trigger.started) {
+      return;
+   }
+   int print = warnings_add(format, cycle, next_cycle, do_emulate ? z80_get_pc() : -1, sample);
+   if (print || arguments.flight_recorder) {
+      snprintf(text, sizeof(text), format, cycle, next_cycle);
+   }
+   if (print) {
+      printf("WARNING: %s\n", text);
+   }
+   if (arguments.flight_recorder) {
+      flight_trigger(text);
+   }
+   if (warnings_exceeded()) {
+      trigger.stopped = 1;
+   }
+}
+
+// ====================================================================
+// Instruction processing
+// ====================================================================
+
+// Classifies the current instruction as a call, return or interrupt (one of
+// the CG_ values), and returns the call target, handler or return address
+static int classify_instruction(int *target) {
+   // Undefined DD/FD opcodes are executed from the main table
+   int main_table = prefix == 0 || prefix == 0xDD || prefix == 0xFD;
+   *target = -1;
+   if (instruction == &z80_interrupt_int) {
+      *target = z80_get_pc();
+      return CG_INT;
+   } else if (instruction == &z80_interrupt_nmi) {
+      *target = 0x66;
+      return CG_NMI;
+   } else if (!taken) {
+      // A conditional CALL or RET that was not taken
+      return CG_OTHER;
+   } else if (main_table && (opcode == 0xCD || (opcode & 0xC7) == 0xC4)) {
+      // CALL nn and CALL cc,nn
+      *target = arg_imm;
+      return CG_CALL;
+   } else if (main_table && (opcode & 0xC7) == 0xC7) {
+      // RST n
+      *target = opcode & 0x38;
+      return CG_CALL;
+   } else if ((main_table && (opcode == 0xC9 || (opcode & 0xC7) == 0xC0)) ||
+              (prefix == 0xED && (opcode & 0xC7) == 0x45)) {
+      // RET, RET cc, RETI and RETN
+      *target = arg_read;
+      return CG_RET;
+   }
+   return CG_OTHER;
+}
+
+// Returns whether the current instruction can transfer control (a jump,
+// call, return or RST), whether or not it did so
+static int is_branch_instruction() {
+   // Undefined DD/FD opcodes are executed from the main table
+   int main_table = prefix == 0 || prefix == 0xDD || prefix == 0xFD;
+   if (main_table) {
+      return opcode == 0x10 || opcode == 0x18 || (opcode & 0xE7) == 0x20 || // DJNZ, JR, JR cc
+         opcode == 0xC3 || opcode == 0xCD || opcode == 0xC9 || opcode == 0xE9 || // JP, CALL, RET, JP (HL)
+         (opcode & 0xC7) == 0xC0 || (opcode & 0xC7) == 0xC2 ||              // RET cc, JP cc
+         (opcode & 0xC7) == 0xC4 || (opcode & 0xC7) == 0xC7;                // CALL cc, RST
+   }
+   return prefix == 0xED && (opcode & 0xC7) == 0x45;                        // RETN, RETI
+}
+
+// Attributes the wait states of each bus cycle to the address it accessed:
+// instruction bytes follow on from the PC, and data accesses are matched in
+// order with the accesses logged by the emulator
+static void busstats_current_instruction(int pc) {
+   static const int log_types[] = { -1, -1, BUS_MEM_READ, BUS_MEM_WRITE, BUS_IO_READ, BUS_IO_WRITE, -1 };
+   const BusAccessType *log;
+   int log_len = z80_get_bus_log(&log);
+   int next[4] = { 0, 0, 0, 0 };
+   int offset = 0;
+   for (int i = 0; i < num_bus_cycles; i++) {
+      BusCycleType *bus = &bus_cycles[i];
+      if (bus->cycle == C_INTACK) {
+         busstats_cycle(BUS_SPACE_INTACK, -1, BUS_READ, bus->wait_cycles);
+      } else if (bus->code) {
+         busstats_cycle(BUS_SPACE_MEMORY, pc >= 0 ? (pc + offset) & 0xffff : -1, BUS_FETCH, bus->wait_cycles);
+         offset++;
+      } else {
+         int type = log_types[bus->cycle];
+         int addr = -1;
+         while (next[type] < log_len && log[next[type]].type != type) {
+            next[type]++;
+         }
+         if (next[type] < log_len) {
+            addr = log[next[type]++].addr;
+         }
+         int space = (type == BUS_IO_READ || type == BUS_IO_WRITE) ? BUS_SPACE_IO : BUS_SPACE_MEMORY;
+         int kind  = (type == BUS_MEM_WRITE || type == BUS_IO_WRITE) ? BUS_WRITE : BUS_READ;
+         busstats_cycle(space, addr, kind, bus->wait_cycles);
+      }
+   }
+}
+
+static CoverageType coverage;
+
+// Marks the instruction bytes, and the memory and IO accessed by the
+// emulated instruction (which started at pc), in the coverage bitmaps
+static void coverage_current_instruction(int pc) {
+   static uint8_t *const maps[] = { coverage.read, coverage.write, coverage.io_read, coverage.io_write };
+   if (pc >= 0 && instruction != &z80_interrupt_int && instruction != &z80_interrupt_nmi) {
+      for (int i = 0; i < instr_len; i++) {
+         COVERAGE_SET(coverage.fetch, (pc + i) & 0xffff);
+      }
+   }
+   const BusAccessType *log;
+   int log_len = z80_get_bus_log(&log);
+   for (int i = 0; i < log_len; i++) {
+      int addr = log[i].addr;
+      if (addr >= 0) {
+         if (log[i].type == BUS_IO_READ || log[i].type == BUS_IO_WRITE) {
+            addr &= 0xff;
+         }
+         COVERAGE_SET(maps[log[i].type], addr);
+      }
+   }
+}
+
+static MemImageType memory_image;
+
+// The number of the current instruction, counting from zero
+static uint64_t instr_num = 0;
+
+// Records the instruction bytes, and the memory values read and written by
+// the emulated instruction (which started at pc), in the memory image
+static void memimage_current_instruction(int pc) {
+   if (pc >= 0 && instruction != &z80_interrupt_int && instruction != &z80_interrupt_nmi) {
+      for (int i = 0; i < instr_len; i++) {
+         memimage_set(&memory_image, (pc + i) & 0xffff, instr_bytes[i], instr_num);
+      }
+   }
+   const BusAccessType *log;
+   int log_len = z80_get_bus_log(&log);
+   for (int i = 0; i < log_len; i++) {
+      if (log[i].addr >= 0 && (log[i].type == BUS_MEM_READ || log[i].type == BUS_MEM_WRITE)) {
+         memimage_set(&memory_image, log[i].addr, log[i].data, instr_num);
+      }
+   }
+   instr_num++;
+}
+
+static void emulate_instruction() {
+   failflag = FAIL_NONE;
+   z80_clear_mem_log();
+   if (bus_log) {
+      z80_clear_bus_log();
+   }
+   z80_emulate(instruction);
+}
+
+// Passes the emulated instruction (which started at pc) to the analysis sinks
+static void analyse_instruction(int pc, int instr_cycles, int wait_cycles) {
+   if (arguments.stop_on_fail && failflag) {
+      trigger.stopped = 1;
+   }
+   if (arguments.flight_recorder && failflag) {
+      flight_trigger("instruction failed");
+   }
+   if (arguments.stats) {
+      stats_fail(instruction, prefix, opcode, failflag);
+   }
+   if (arguments.fail_report) {
+      failreport_instruction(instruction, prefix, opcode, failflag, pc, instr_sample);
+   }
+   if (arguments.callgrind || arguments.folded || arguments.int_stats || arguments.stack_stats || arguments.cfg || arguments.trace) {
+      // The return address is the value pushed by a call or interrupt
+      int target;
+      int kind = classify_instruction(&target);
+      if (arguments.callgrind || arguments.folded) {
+         callgraph_instruction(kind, target, arg_write, z80_get_sp(), instr_cycles, wait_cycles);
+      }
+      if (arguments.int_stats) {
+         intstats_instruction(kind, target, arg_write, z80_get_pc(), z80_get_sp(), instr_cycles);
+      }
+      if (arguments.stack_stats) {
+         stackstats_instruction(kind, target, arg_write, pc, z80_get_sp(), instr_cycles);
+      }
+      if (arguments.cfg) {
+         cfg_instruction(kind, target, pc, is_branch_instruction(), instr_bytes, instr_len, instr_cycles);
+      }
+      if (arguments.trace) {
+         // Repeating block instructions (LDIR, CPIR, INIR, OTIR and the decrementing forms)
+         int block = prefix == 0xED && (opcode & 0xF4) == 0xB0;
+         int halted = instr_len == 0 && kind != CG_INT && kind != CG_NMI;
+         trace_instruction(kind, target, arg_write, z80_get_sp(), pc, instr_sample, instr_cycles, halted, block ? mnemonic : NULL);
+      }
+   }
+   if (arguments.bus_stats) {
+      busstats_current_instruction(pc);
+   }
+   if (arguments.coverage || arguments.coverage_report) {
+      coverage_current_instruction(pc);
+   }
+   if (arguments.dump_memory) {
+      memimage_current_instruction(pc);
+   }
+}
+
+// Evaluates the filter on the emulated instruction (which started at pc)
+static int filter_current_instruction(int pc, int cycle_types) {
+   const BusAccessType *log = NULL;
+   int log_len = bus_log ? z80_get_bus_log(&log) : 0;
+   int classes = 0;
+   if (filter_uses_classes()) {
+      int target;
+      int kind = classify_instruction(&target);
+      int interrupt = kind == CG_INT || kind == CG_NMI;
+      if (cycle_types & (1 << C_IORD)) {
+         classes |= FILTER_IN;
+      }
+      if (cycle_types & (1 << C_IOWR)) {
+         classes |= FILTER_OUT;
+      }
+      if (cycle_types & (1 << C_MEMRD)) {
+         classes |= FILTER_READ;
+      }
+      if (cycle_types & (1 << C_MEMWR)) {
+         classes |= FILTER_WRITE;
+      }
+      if (is_branch_instruction()) {
+         classes |= FILTER_BRANCH;
+      }
+      if (kind == CG_CALL) {
+         classes |= FILTER_CALL;
+      } else if (kind == CG_RET) {
+         classes |= FILTER_RET;
+      } else if (interrupt) {
+         classes |= FILTER_INT;
+      }
+      if (prefix == 0xED && (opcode & 0xF4) == 0xB0) {
+         classes |= FILTER_BLOCK;
+      }
+      if (instr_len == 0 && !interrupt) {
+         classes |= FILTER_HALT;
+      }
+      if (failflag) {
+         classes |= FILTER_FAIL;
+      }
+   }
+   return filter_match(pc, classes, log, log_len);
+}
+
+static void process_instruction(int instr_cycles, int wait_cycles) {
+   // We have everything available to process a complete instruction
+   int colon = 0;
+   int pc = z80_get_pc();
+   if (arguments.filter) {
+      // Emulate first, so instructions that do not match are never formatted
+      emulate_instruction();
+      analyse_instruction(pc, instr_cycles, wait_cycles);
+      if (!arguments.stats && filter_current_instruction(pc, instr_cycle_types)) {
+         print_state(print_instruction(pc, 0, instr_cycles, wait_cycles));
+         trigger.instructions++;
+      }
+      return;
+   }
+   int held = arguments.collapse_loops && !arguments.stats && hold_loop_instruction(pc, instr_cycles, wait_cycles);
+   // When only the statistics are wanted, skip the formatting entirely
+   if (!arguments.stats && !held) {
+      colon = print_instruction(pc, 0, instr_cycles, wait_cycles);
+   }
+   if (do_emulate) {
+      // Run the emulation
+      emulate_instruction();
+      analyse_instruction(pc, instr_cycles, wait_cycles);
+   }
+   if (held) {
+      held_loop_instruction_done(pc, instr_cycles, wait_cycles);
+   } else if (!arguments.stats) {
+      print_state(colon);
+   }
+}
+
+// ====================================================================
+// Profiling
+// ====================================================================
+
+// The first instruction decoded at each address, for the profile listing
+static InstrContextType *profile_context;
+
+static void profile_current_instruction(int instr_cycles, int wait_cycles) {
+   int pc = z80_get_pc();
+   if (instruction == &z80_interrupt_int) {
+      pc = PROFILE_INT;
+   } else if (instruction == &z80_interrupt_nmi) {
+      pc = PROFILE_NMI;
+   } else if (pc < 0) {
+      pc = PROFILE_UNKNOWN;
+   }
+   if (profile_instruction(pc, instr_cycles, wait_cycles) && pc < 0x10000) {
+      save_context(&profile_context[pc]);
+   }
+}
+
+static int profile_disassemble(FILE *stream, int pc) {
+   InstrContextType current;
+   save_context(&current);
+   restore_context(&profile_context[pc]);
+   for (int i = 0; i < MAX_INSTR_LEN; i++) {
+      if (i < instr_len) {
+         fprintf(stream, "%02X ", instr_bytes[i]);
+      } else {
+         fprintf(stream, "   ");
+      }
+   }
+   char buffer[256];
+   format_mnemonic(buffer, sizeof(buffer), pc);
+   fprintf(stream, ": %s", buffer);
+   int len = instr_len;
+   restore_context(&current);
+   return len;
+}
+
+// ====================================================================
+// Block instruction runs
+// ====================================================================
+
+// The iterations of a repeating block instruction (e.g. LDIR) are collected
+// into a run, which is emulated in bulk. The run is printed as a single line
+// with --block-summary, and otherwise one line per iteration.
+
+#define MAX_BLOCK_RUN 0x10000
+
+static struct {
+   int active;
+   InstrContextType context;
+   int n;
+   int instr_cycles;
+   int wait_cycles;
+   int cycle_types;
+   uint8_t rd[MAX_BLOCK_RUN];
+   uint8_t wr[MAX_BLOCK_RUN];
+   // Each iteration, for printing them individually
+   int iter_cycles[MAX_BLOCK_RUN];
+   int iter_waits[MAX_BLOCK_RUN];
+   uint64_t iter_samples[MAX_BLOCK_RUN];
+   uint64_t iter_tstates[MAX_BLOCK_RUN];
+} block_run;
+
+// Prints the run (which starts at pc), returning whether anything was
+// printed on the last line, which print_state() completes
+static int print_block_run(int pc) {
+   if (arguments.block_summary) {
+      return print_instruction(pc, block_run.n > 1 ? block_run.n : 0, block_run.instr_cycles, block_run.wait_cycles);
+   }
+   int colon = 0;
+   for (int i = 0; i < block_run.n; i++) {
+      if (i) {
+         end_line(colon);
+      }
+      instr_sample = block_run.iter_samples[i];
+      instr_tstate = block_run.iter_tstates[i];
+      colon = print_instruction(pc, 0, block_run.iter_cycles[i], block_run.iter_waits[i]);
+   }
+   instr_sample = block_run.context.instr_sample;
+   instr_tstate = block_run.context.instr_tstate;
+   return colon;
+}
+
+static void flush_block_run() {
+   if (!block_run.active) {
+      return;
+   }
+   if (arguments.collapse_loops) {
+      break_loop();
+   }
+   // The decoder may have moved on to the next instruction
+   InstrContextType current;
+   save_context(&current);
+   restore_context(&block_run.context);
+   int pc = z80_get_pc();
+   int show = !arguments.stats && !arguments.filter;
+   int colon = show ? print_block_run(pc) : 0;
+   failflag = FAIL_NONE;
+   z80_clear_mem_log();
+   z80_emulate_block_run(instruction, block_run.rd, block_run.wr, block_run.n);
+   analyse_instruction(pc, block_run.instr_cycles, block_run.wait_cycles);
+   if (arguments.filter && !arguments.stats && filter_current_instruction(pc, block_run.cycle_types)) {
+      colon = print_block_run(pc);
+      show = 1;
+      trigger.instructions += arguments.block_summary ? 1 : block_run.n;
+   }
+   if (show) {
+      print_state(colon);
+   }
+   restore_context(&current);
+   block_run.active = 0;
+}
+
+static int continues_block_run() {
+   return block_run.active && prefix == 0xED && opcode == block_run.context.opcode &&
+      instruction != &z80_interrupt_int && instruction != &z80_interrupt_nmi;
+}
+
+// Adds the current instruction to a block run, returning zero if it is not
+// part of one (and should be processed normally)
+static int add_to_block_run(int instr_cycles, int wait_cycles) {
+   if (!block_run.active) {
+      // A run of one iteration is just processed normally
+      if (instruction == &z80_interrupt_int || instruction == &z80_interrupt_nmi || !z80_block_run_start() ||
+          z80_block_run_ends(0, arg_read)) {
+         return 0;
+      }
+      block_run.active       = 1;
+      save_context(&block_run.context);
+      block_run.n            = 0;
+      block_run.instr_cycles = 0;
+      block_run.wait_cycles  = 0;
+      block_run.cycle_types  = 0;
+   }
+   int n = block_run.n++;
+   block_run.rd[n] = arg_read;
+   block_run.wr[n] = arg_write;
+   block_run.iter_cycles[n]  = instr_cycles;
+   block_run.iter_waits[n]   = wait_cycles;
+   block_run.iter_samples[n] = instr_sample;
+   block_run.iter_tstates[n] = instr_tstate;
+   block_run.instr_cycles += instr_cycles;
+   block_run.wait_cycles  += wait_cycles;
+   block_run.cycle_types  |= instr_cycle_types;
+   if (z80_block_run_ends(n, arg_read) || block_run.n == MAX_BLOCK_RUN) {
+      flush_block_run();
+   }
+   return 1;
+}
+
+// ====================================================================
+// Bus cycle processing
+// ====================================================================
+
 void decode_cycle(Z80CycleSummaryType *cycle_q) {
 
    static int m_cycle = 0;
    static int instr_cycles = 0;
    static int wait_cycles = 0;
+   static uint64_t start_sample = 0;
+   // Set once the first cycle of the instruction has been seen
+   static int start_latched = 0;
+   static uint64_t tstate = 0;
+   static int bus_counts[METRICS_NUM_BUS];
+   // The metrics bus cycle count for each cycle type
+   static const int metrics_bus[] = { -1, METRICS_FETCH, METRICS_MEM_READ, METRICS_MEM_WRITE, METRICS_IO_READ, METRICS_IO_WRITE, -1 };
    int ret;
-   int colon;
-   char target[10];
+
+   if (trigger.stopped) {
+      return;
+   }
 
    do {
 
+      // Cycles before any read/write operands are instruction bytes
+      int code = state < S_ROP1;
+
       ret = decode_instruction(cycle_q);
 
       // Output the samples for this cycle, as long as they are processed
       if (!(ret & BIT_UNPROCESSED)) {
 
+         if (!start_latched) {
+            start_sample = cycle_q->sample_num;
+            start_latched = 1;
+         }
          instr_cycles += cycle_q->instr_cycles;
          wait_cycles += cycle_q->wait_cycles;
+         if (!code) {
+            instr_cycle_types |= 1 << cycle_q->cycle;
+         }
 
-         if (arguments.debug > 0) {
+         if (arguments.flight_recorder) {
+            flight_record_cycle(cycle_q);
+         }
+
+         if (arguments.metrics && metrics_bus[cycle_q->cycle] >= 0) {
+            bus_counts[metrics_bus[cycle_q->cycle]]++;
+         }
+
+         if (arguments.bus_stats && num_bus_cycles < MAX_BUS_CYCLES) {
+            BusCycleType *bus = &bus_cycles[num_bus_cycles++];
+            bus->cycle       = cycle_q->cycle;
+            bus->code        = code;
+            bus->wait_cycles = cycle_q->wait_cycles;
+         }
+
+         if (arguments.debug > 0 && trigger.started) {
 
             if (cycle_q->cycle == C_FETCH) {
                m_cycle = 1;
@@ -720,26 +2240,7 @@ void decode_cycle(Z80CycleSummaryType *cycle_q) {
             }
 
             if (arguments.debug > 1) {
-               int end = cycle_q->num_samples;
-               for (int i = 0; i < end; i++) {
-                  uint16_t sample = sample_buffer[(cycle_q->sample_index + i) & (SAMPLE_BUFSIZE - 1)];
-                  Z80CycleType cycle = get_cycle_type(sample);
-                  int m1   = (sample >> arguments.idx_m1  ) & 1;
-                  int rd   = (sample >> arguments.idx_rd  ) & 1;
-                  int wr   = (sample >> arguments.idx_wr  ) & 1;
-                  int mreq = (sample >> arguments.idx_mreq) & 1;
-                  int iorq = (sample >> arguments.idx_iorq) & 1;
-                  int wait = (sample >> arguments.idx_wait) & 1;
-                  int rst  = (sample >> arguments.idx_rst ) & 1;
-                  int phi  = (sample >> arguments.idx_phi ) & 1;
-                  int data = (sample >> arguments.idx_data) & 255;
-                  printf("M%d %6s %d %d %d %d %d %d %d %d %02x ",
-                         m_cycle, cycle_names[cycle],
-                         m1, rd, wr, mreq, iorq, wait, rst, phi, data);
-                  if (i < end - 1) {
-                     printf("\n");
-                  }
-               }
+               print_samples(sample_buffer, SAMPLE_BUFSIZE - 1, cycle_q->sample_index, cycle_q->num_samples, m_cycle);
             } else {
                printf("M%d %6s %02x %2d/%2d",
                       m_cycle, cycle_names[cycle_q->cycle],
@@ -772,140 +2273,78 @@ void decode_cycle(Z80CycleSummaryType *cycle_q) {
 
       // Handle Warnings
       if (ann_dasm == ANN_WARN) {
-         printf("WARNING: %s\n", mnemonic);
+         flush_block_run();
+         if (arguments.collapse_loops) {
+            break_loop();
+         }
+         report_warning(warning_format, warning_cycle, NULL, cycle_q->sample_num);
          ann_dasm = ANN_NONE;
+         num_bus_cycles = 0;
+         instr_cycle_types = 0;
       }
 
       if (ret & BIT_INSTRUCTION) {
 
-         if (arguments.debug > 0) {
+         if (arguments.debug > 0 && trigger.started) {
             printf("\n");
          }
 
-         if (instr_cycles + wait_cycles > RESET_THRESHOLD) {
-            z80_reset();
-            printf("INFO: RESET inferred\n");
-         }
+         int reset = instr_cycles + wait_cycles > RESET_THRESHOLD;
 
-         int count = 0;
-         colon = 0;
-         // We have everything available to process a complete instruction
-         if (arguments.show_address) {
-            if (z80_get_pc() >= 0) {
-               printf("%04X", z80_get_pc());
-            } else {
-               printf("????");
-            }
-            colon = 1;
+         if (reset || !continues_block_run()) {
+            flush_block_run();
          }
-         if (arguments.show_hex) {
-            if (colon) {
-               printf(" : ");
-            }
-            for (int i = 0; i < MAX_INSTR_LEN; i++) {
-               if (i < instr_len) {
-                  printf("%02X ", instr_bytes[i]);
-               } else {
-                  printf("   ");
-               }
-            }
-            colon = 1;
-         }
-         if (arguments.show_instruction) {
-            if (colon) {
-               printf(" : ");
-            }
-            switch (format) {
-            case TYPE_1:
-               count = printf(mnemonic, arg_reg);
-               break;
-            case TYPE_2:
-               count = printf(mnemonic, arg_reg, arg_reg);
-               break;
-            case TYPE_3:
-               count = printf(mnemonic, arg_imm, arg_reg);
-               break;
-            case TYPE_4:
-               count = printf(mnemonic, arg_reg, arg_imm);
-               break;
-            case TYPE_5:
-               count = printf(mnemonic, arg_reg, arg_dis);
-               break;
-            case TYPE_6:
-               count = printf(mnemonic, arg_reg, arg_dis, arg_imm);
-               break;
-            case TYPE_7:
-               if (z80_get_pc() >= 0) {
-                  sprintf(target, "%04Xh", (z80_get_pc() + instr_len + arg_dis) & 0xffff);
-               } else {
-                  sprintf(target, "$%+d", arg_dis + instr_len);
-               }
-               count = printf(mnemonic, target);
-               break;
-            case TYPE_8:
-               count = printf(mnemonic, arg_imm);
-               break;
-            default:
-               count = printf(mnemonic, 0);
-               break;
+
+         if (reset) {
+            if (arguments.collapse_loops) {
+               break_loop();
             }
-            // Pad the disassembled instruction
-            if (arguments.show_cycles || arguments.show_state) {
-               while (count++ < 20) {
-                  printf(" ");
-               }
+            z80_reset();
+            if (trigger.started) {
+               printf("INFO: RESET inferred\n");
             }
-            colon = 1;
+            tstate = 0;
          }
-         if (arguments.show_cycles) {
-            if (colon) {
-               printf(" : ");
-            }
-            printf("%2d/%2d", instr_cycles, wait_cycles);
-            colon = 1;
+
+         instr_sample = start_sample;
+         start_latched = 0;
+         instr_tstate = tstate;
+         tstate += instr_cycles;
+
+         if (arguments.flight_recorder) {
+            flight_record_instruction(z80_get_pc());
          }
-         if (do_emulate) {
-            // Run the emulation
-            failflag = FAIL_NONE;
-            z80_clear_mem_log();
-            if (instruction && instruction->emulate) {
-               instruction->emulate(instruction);
+
+         if (trigger_instruction(instr_sample)) {
+
+            if (arguments.metrics) {
+               int interrupt = instruction == &z80_interrupt_int || instruction == &z80_interrupt_nmi;
+               metrics_instruction(instr_sample, z80_get_pc(), instr_cycles, wait_cycles, instr_len == 0 && !interrupt, interrupt, bus_counts);
             }
-         }
-         if (arguments.show_state || failflag) {
-            if (colon) {
-               printf(" : ");
+
+            if (arguments.stats) {
+               stats_instruction(instruction, prefix, opcode, instr_cycles, wait_cycles);
             }
-            // Show the state after executing this instruction
-            printf("%s", z80_get_state(arguments.show_state));
-            if (failflag > FAIL_NONE) {
-               if (failflag & FAIL_ERROR) {
-                  printf(" : fail");
-               }
-               if (failflag & FAIL_MEMORY) {
-                  printf(" : ");
-                  z80_dump_mem_log();
-                  // printf(" : memory modelling");
-               }
-               if (failflag & FAIL_NOT_IMPLEMENTED) {
-                  printf(" : not implemented");
-               }
-               if (failflag & FAIL_IMPLEMENTATION_ERROR) {
-                  printf(" : implementation error");
-               }
+
+            if (arguments.profile) {
+               profile_current_instruction(instr_cycles, wait_cycles);
             }
-            colon = 1;
-         }
-         if (colon) {
-            printf("\n");
-            if (arguments.debug > 0) {
-               printf("\n");
+
+            if (!arguments.block_bulk || !add_to_block_run(instr_cycles, wait_cycles)) {
+               process_instruction(instr_cycles, wait_cycles);
             }
+
+         } else if (do_emulate && !trigger.stopped) {
+            // Before the start trigger only the emulator state is updated
+            emulate_instruction();
          }
 
          // Reset the instruction variables
          instr_cycles = 0;
          wait_cycles = 0;
+         num_bus_cycles = 0;
+         instr_cycle_types = 0;
+         memset(bus_counts, 0, sizeof(bus_counts));
       }
 
    } while (ret & BIT_UNPROCESSED);
@@ -928,6 +2367,7 @@ void lookahead_decode_cycle(Z80CycleSummaryType *cycle_summary) {
 void decode_sample(int sample) {
    static Z80CycleType prev_cycle    = C_NONE;
    static int sample_index           = 0;
+   static uint64_t sample_num        = 0;
    static int prev_data              = 0;
    static int prev_phi               = 0;
    static int prev_wait              = 0;
@@ -946,9 +2386,7 @@ void decode_sample(int sample) {
    sample_buffer[sample_index] = sample;
 
    if (cycle != prev_cycle && cycle != C_NONE && prev_cycle != C_NONE) {
-      printf("WARNING: unexpected transition from %s to %s\n",
-             cycle_names[prev_cycle],
-             cycle_names[cycle]);
+      report_warning("unexpected transition from %s to %s", cycle_names[prev_cycle], cycle_names[cycle], sample_num);
    }
 
    // Increment cycles counts on the falling edge of Phi, where wait is accurate
@@ -979,6 +2417,7 @@ void decode_sample(int sample) {
       cycle_summary.instr_cycles = 0;
       cycle_summary.wait_cycles  = 0;
       cycle_summary.sample_index = sample_index;
+      cycle_summary.sample_num   = sample_num;
    }
 
    prev_cycle   = cycle;
@@ -986,6 +2425,7 @@ void decode_sample(int sample) {
    prev_phi     = phi;
    prev_data    = data;
    sample_index = (sample_index + 1) & (SAMPLE_BUFSIZE - 1);
+   sample_num++;
 
 }
 
@@ -1000,13 +2440,13 @@ void decode(FILE *stream) {
    int num;
    uint16_t sample;
 
-   z80_init(arguments.cpu, arguments.default_im);
+   z80_init(arguments.cpu, arguments.default_im, arguments.mem_model);
 
-   while ((num = fread(buffer, sizeof(uint16_t), READ_BUFSIZE, stream)) > 0) {
+   while (!trigger.stopped && (num = fread(buffer, sizeof(uint16_t), READ_BUFSIZE, stream)) > 0) {
 
       uint16_t *sampleptr = &buffer[0];
 
-      while (num-- > 0) {
+      while (num-- > 0 && !trigger.stopped) {
 
          sample = *sampleptr++;
 
@@ -1016,33 +2456,33 @@ void decode(FILE *stream) {
    }
 
    // Flush the lookhead decoder with NOPs
-   for (int i = 0; i < DEPTH - 1; i++) {
+   for (int i = 0; i < DEPTH - 1 && !trigger.stopped; i++) {
       Z80CycleSummaryType dummy;
       dummy.cycle = C_FETCH;
       dummy.data = 0;
       dummy.instr_cycles = 4;
       dummy.wait_cycles  = 0;
       dummy.sample_index = 0; // TOOD
+      dummy.sample_num   = 0;
       lookahead_decode_cycle(&dummy);
    }
 
+   flush_block_run();
+
+   if (arguments.collapse_loops) {
+      end_loop();
+   }
+
+   if (flight.pending) {
+      flight_dump();
+   }
+
 }
 
 // ====================================================================
 // Main program entry point
 // ====================================================================
 
-int dump_counts(int prefix) {
-   int total = 0;
-   InstrType *instruction = table_by_prefix(prefix);
-   for (int i = 0; i < 256; i++) {
-      fprintf(stderr, "%02x %02x %10d %s\n",
-             prefix, i, instruction[i].count, instruction[i].mnemonic);
-      total += instruction[i].count;
-   }
-   return total;
-}
-
 int main(int argc, char *argv[]) {
    arguments.idx_data         =  0;
    arguments.idx_m1           =  8;
@@ -1059,15 +2499,111 @@ int main(int argc, char *argv[]) {
    arguments.show_instruction = 0;
    arguments.show_state       = 0;
    arguments.show_cycles      = 0;
+   arguments.show_time        = 0;
+   arguments.samplerate       = 0;
    arguments.cpu              = CPU_DEFAULT;
    arguments.debug            = 0;
    arguments.default_im       = -1; // unknoen
+   arguments.mem_model        = 0;
+   arguments.mem_map          = NULL;
+   arguments.block_bulk       = 0;
+   arguments.block_summary    = 0;
+   arguments.stats            = NULL;
+   arguments.profile          = NULL;
+   arguments.profile_top      = 20;
+   arguments.callgrind        = NULL;
+   arguments.folded           = NULL;
+   arguments.bus_stats        = NULL;
+   arguments.int_stats        = NULL;
+   arguments.stack_stats      = NULL;
+   arguments.coverage         = NULL;
+   arguments.coverage_report  = NULL;
+   arguments.dump_memory      = NULL;
+   arguments.symbols          = 0;
+   arguments.collapse_loops   = 0;
+   arguments.cfg              = NULL;
+   arguments.metrics          = NULL;
+   arguments.trace            = NULL;
+   arguments.start_sample     = 0;
+   arguments.stop_sample      = UINT64_MAX;
+   arguments.start_pc         = -1;
+   arguments.start_pc_count   = 0;
+   arguments.stop_pc          = -1;
+   arguments.stop_pc_count    = 0;
+   arguments.stop_after       = 0;
+   arguments.stop_on_fail     = 0;
+   arguments.filter           = 0;
+   arguments.flight_recorder  = 0;
+   arguments.warn_summary     = 0;
+   arguments.fail_report      = NULL;
+   arguments.fail_first       = 100;
    argp_parse(&argp, argc, argv, 0, 0, &arguments);
 
-   if (arguments.show_address || arguments.show_state) {
+   if (arguments.show_address || arguments.show_state || arguments.mem_model || arguments.block_bulk || arguments.stats || arguments.profile ||
+       arguments.callgrind || arguments.folded || arguments.bus_stats ||
+       arguments.int_stats || arguments.stack_stats || arguments.coverage || arguments.coverage_report ||
+       arguments.dump_memory || arguments.symbols || arguments.collapse_loops ||
+       arguments.cfg || arguments.metrics || arguments.trace ||
+       arguments.start_pc_count || arguments.stop_pc_count || arguments.stop_on_fail || arguments.filter ||
+       arguments.flight_recorder || arguments.fail_report) {
       do_emulate = 1;
    }
 
+   trigger.started = !arguments.start_sample && !arguments.start_pc_count;
+
+   if (arguments.bus_stats || arguments.coverage || arguments.coverage_report || arguments.dump_memory ||
+       (arguments.filter && filter_uses_bus())) {
+      // Bus accesses are attributed per instruction, so block runs are not collected
+      arguments.block_bulk = 0;
+      arguments.block_summary = 0;
+      z80_set_bus_log(1);
+      bus_log = 1;
+   }
+
+   if (arguments.cfg) {
+      // Each iteration of a block instruction counts as an execution, with
+      // an edge back to itself, so block runs are not collected
+      arguments.block_bulk = 0;
+      arguments.block_summary = 0;
+   }
+
+   if (arguments.bus_stats) {
+      busstats_init();
+   }
+
+   if (arguments.mem_map && memmap_load(arguments.mem_map)) {
+      return 2;
+   }
+
+   if (!arguments.stats) {
+      // Without the cache the output is just slower
+      disasm_cache = calloc(0x10000, sizeof(DisasmCacheEntryType));
+   }
+
+   if (arguments.flight_recorder && flight_init(arguments.flight_recorder)) {
+      return 2;
+   }
+
+   if (arguments.fail_report && failreport_init(arguments.fail_first)) {
+      return 2;
+   }
+
+   if (arguments.metrics && metrics_open(arguments.metrics)) {
+      return 2;
+   }
+
+   if (arguments.trace && trace_open(arguments.trace, arguments.samplerate, arguments.symbols ? symbols_lookup : NULL)) {
+      return 2;
+   }
+
+   if (arguments.profile) {
+      profile_context = calloc(0x10000, sizeof(InstrContextType));
+      if (!profile_context) {
+         perror("failed to allocate profile");
+         return 2;
+      }
+   }
+
    FILE *stream;
    if (!arguments.filename || !strcmp(arguments.filename, "-")) {
       stream = stdin;
@@ -1081,17 +2617,70 @@ int main(int argc, char *argv[]) {
    decode(stream);
    fclose(stream);
 
-#ifdef DUMP_COVERAGE
-   int total = 0;
-   total += dump_counts(0x00);
-   total += dump_counts(0xCB);
-   total += dump_counts(0xDD);
-   total += dump_counts(0xED);
-   total += dump_counts(0xFD);
-   total += dump_counts(0xDDCB);
-   total += dump_counts(0xFDCB);
-   fprintf(stderr, "Total = %d\n", total);
-#endif
+   if (arguments.warn_summary) {
+      warnings_summary(stdout);
+   }
+
+   if (arguments.stats && stats_write(arguments.stats)) {
+      return 2;
+   }
+
+   if (arguments.profile && profile_write(arguments.profile, arguments.profile_top, profile_disassemble)) {
+      return 2;
+   }
+
+   if (arguments.callgrind && callgraph_write_callgrind(arguments.callgrind)) {
+      return 2;
+   }
+
+   if (arguments.folded && callgraph_write_folded(arguments.folded)) {
+      return 2;
+   }
+
+   if (arguments.bus_stats && busstats_write(arguments.bus_stats)) {
+      return 2;
+   }
+
+   if (arguments.int_stats && intstats_write(arguments.int_stats)) {
+      return 2;
+   }
+
+   if (arguments.stack_stats && stackstats_write(arguments.stack_stats)) {
+      return 2;
+   }
+
+   if (arguments.coverage && coverage_save(arguments.coverage, &coverage)) {
+      return 2;
+   }
+
+   if (arguments.coverage_report && coverage_write_report(arguments.coverage_report, &coverage)) {
+      return 2;
+   }
+
+   if (arguments.dump_memory && memimage_save(arguments.dump_memory, &memory_image)) {
+      return 2;
+   }
+
+   if (arguments.cfg && cfg_write(arguments.cfg)) {
+      return 2;
+   }
+
+   if (arguments.metrics && metrics_close()) {
+      return 2;
+   }
+
+   if (arguments.trace && trace_close()) {
+      return 2;
+   }
+
+   if (arguments.fail_report && failreport_write(arguments.fail_report)) {
+      return 2;
+   }
+
+   if (warnings_exceeded()) {
+      fprintf(stderr, "decoding abandoned after %" PRIu64 " warnings\n", warnings_total());
+      return 1;
+   }
 
    return 0;
 }
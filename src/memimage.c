@@ -0,0 +1,143 @@
+//
+// Memory image reconstruction
+//
+// The value of every byte fetched as part of an instruction, or read or
+// written as data, is recorded at its (CPU) address, together with a
+// validity bit and the number of the instruction (counting from zero at
+// the start of the capture) when that address was first seen. The image
+// holds the most recent value seen.
+//
+// The image file is an 8 byte header ("Z80MEM01") followed by the 64K
+// data bytes, the 8K validity bitmap (bit n is bit (n & 7) of byte
+// (n >> 3)) and a 64 bit little endian first seen instruction number for
+// each address.
+//
+// Images from many captures can be combined with memmerge.
+
+#include <stdio.h>
+#include <string.h>
+#include "memimage.h"
+
+static const char magic[8] = { 'Z', '8', '0', 'M', 'E', 'M', '0', '1' };
+
+void memimage_set(MemImageType *image, int addr, int data, uint64_t instr_num) {
+   if (!MEMIMAGE_VALID(image, addr)) {
+      image->valid[addr >> 3] |= 1 << (addr & 7);
+      image->first_seen[addr] = instr_num;
+   }
+   image->data[addr] = data;
+}
+
+static void encode_u64(uint8_t *buffer, uint64_t value) {
+   for (int i = 0; i < 8; i++) {
+      buffer[i] = (value >> (i * 8)) & 0xff;
+   }
+}
+
+static uint64_t decode_u64(const uint8_t *buffer) {
+   uint64_t value = 0;
+   for (int i = 0; i < 8; i++) {
+      value |= (uint64_t) buffer[i] << (i * 8);
+   }
+   return value;
+}
+
+int memimage_load(const char *filename, MemImageType *image) {
+   static uint8_t first_seen[0x10000 * 8];
+   char header[sizeof(magic)];
+   FILE *stream = fopen(filename, "rb");
+   if (!stream) {
+      perror(filename);
+      return 1;
+   }
+   int ok = fread(header, sizeof(header), 1, stream) == 1 &&
+      !memcmp(header, magic, sizeof(magic)) &&
+      fread(image->data, sizeof(image->data), 1, stream) == 1 &&
+      fread(image->valid, sizeof(image->valid), 1, stream) == 1 &&
+      fread(first_seen, sizeof(first_seen), 1, stream) == 1;
+   fclose(stream);
+   if (!ok) {
+      fprintf(stderr, "%s: not a memory image file\n", filename);
+      return 1;
+   }
+   for (int addr = 0; addr < 0x10000; addr++) {
+      image->first_seen[addr] = decode_u64(first_seen + addr * 8);
+   }
+   return 0;
+}
+
+int memimage_save(const char *filename, const MemImageType *image) {
+   static uint8_t first_seen[0x10000 * 8];
+   FILE *stream = fopen(filename, "wb");
+   if (!stream) {
+      perror("failed to open memory image file");
+      return 1;
+   }
+   for (int addr = 0; addr < 0x10000; addr++) {
+      encode_u64(first_seen + addr * 8, image->first_seen[addr]);
+   }
+   int ok = fwrite(magic, sizeof(magic), 1, stream) == 1 &&
+      fwrite(image->data, sizeof(image->data), 1, stream) == 1 &&
+      fwrite(image->valid, sizeof(image->valid), 1, stream) == 1 &&
+      fwrite(first_seen, sizeof(first_seen), 1, stream) == 1;
+   if (fclose(stream) || !ok) {
+      perror("failed to write memory image file");
+      return 1;
+   }
+   return 0;
+}
+
+// Writes the raw 64K image, with fill in place of the unknown bytes
+int memimage_save_binary(const char *filename, const MemImageType *image, int fill) {
+   static uint8_t data[0x10000];
+   FILE *stream = fopen(filename, "wb");
+   if (!stream) {
+      perror("failed to open binary image file");
+      return 1;
+   }
+   for (int addr = 0; addr < 0x10000; addr++) {
+      data[addr] = MEMIMAGE_VALID(image, addr) ? image->data[addr] : fill;
+   }
+   int ok = fwrite(data, sizeof(data), 1, stream) == 1;
+   if (fclose(stream) || !ok) {
+      perror("failed to write binary image file");
+      return 1;
+   }
+   return 0;
+}
+
+// Adds the bytes known in other but not in image, returning the number of
+// bytes known in both with different values (where image is kept)
+int memimage_merge(MemImageType *image, const MemImageType *other) {
+   int conflicts = 0;
+   for (int addr = 0; addr < 0x10000; addr++) {
+      if (MEMIMAGE_VALID(other, addr)) {
+         if (!MEMIMAGE_VALID(image, addr)) {
+            image->valid[addr >> 3] |= 1 << (addr & 7);
+            image->data[addr] = other->data[addr];
+            image->first_seen[addr] = other->first_seen[addr];
+         } else if (image->data[addr] != other->data[addr]) {
+            conflicts++;
+         }
+      }
+   }
+   return conflicts;
+}
+
+void memimage_report(FILE *stream, const MemImageType *image) {
+   int start = 0;
+   int total = 0;
+   int start_valid = MEMIMAGE_VALID(image, 0);
+   for (int addr = 0; addr <= 0x10000; addr++) {
+      int valid = addr < 0x10000 ? MEMIMAGE_VALID(image, addr) : -1;
+      if (valid != start_valid) {
+         fprintf(stream, "%04X-%04X %s\n", start, addr - 1, start_valid ? "known" : "unknown");
+         start = addr;
+         start_valid = valid;
+      }
+      if (valid > 0) {
+         total++;
+      }
+   }
+   fprintf(stream, "\n%d bytes known\n", total);
+}
@@ -0,0 +1,24 @@
+#ifndef _INCLUDE_MEMIMAGE_H
+#define _INCLUDE_MEMIMAGE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+// A memory image reconstructed from the bus traffic
+typedef struct {
+   uint8_t data[0x10000];
+   uint8_t valid[0x10000 / 8];
+   // The number of the instruction that first saw each byte
+   uint64_t first_seen[0x10000];
+} MemImageType;
+
+#define MEMIMAGE_VALID(image, addr) (((image)->valid[(addr) >> 3] >> ((addr) & 7)) & 1)
+
+void memimage_set(MemImageType *image, int addr, int data, uint64_t instr_num);
+int  memimage_load(const char *filename, MemImageType *image);
+int  memimage_save(const char *filename, const MemImageType *image);
+int  memimage_save_binary(const char *filename, const MemImageType *image, int fill);
+int  memimage_merge(MemImageType *image, const MemImageType *other);
+void memimage_report(FILE *stream, const MemImageType *image);
+
+#endif
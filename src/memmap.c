@@ -0,0 +1,359 @@
+//
+// Banked/paged shadow memory for the memory modelling
+//
+// By default the shadow memory is a single flat 64K page. A description
+// file can split the address space into fixed size windows, each of which
+// maps one of a number of physical pages. The mapping is changed by IO
+// writes, so that memory modelling of banked systems does not report
+// conflicts after every bank switch.
+//
+// The description file is line based, with # starting a comment:
+//
+//   pagesize <bytes>
+//      The window size, a power of two between 256 and 65536 (default 16K).
+//      If present, this must come before any other directive.
+//
+//   fixed <addr> page <n>
+//      The window at <addr> always maps physical page <n>.
+//
+//   bank <addr> port <p> mask <m> data <d> [base <b>] [init <n>] [lock <l>]
+//      The window at <addr> is switched by a write to any port where
+//      (port & m) == (p & m). The bits of the written value selected by
+//      <d> are packed together to give the bank number, which is added to
+//      <b> to give the physical page. At reset, page <n> is mapped
+//      (default <b>). Once a value with any of the bits <l> set has been
+//      written, the window is not switched again until reset.
+//
+// Windows not mentioned in the file map a private page of their own.
+// Physical pages are shared between windows, so aliases are modelled
+// correctly. The shadow storage for each page is allocated on first write.
+//
+// Numbers may be decimal, hex (0x prefix) or have a K suffix.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "memmap.h"
+
+#define MAX_WINDOWS  256
+#define MAX_PAGES    256
+#define MAX_RULES     64
+
+// Window mapping values other than a physical page number
+#define PAGE_PRIVATE -1
+#define PAGE_UNKNOWN -2
+
+typedef struct {
+   uint8_t *data;
+   uint8_t *valid;
+} ShadowPage;
+
+typedef struct {
+   int window;
+   int port;
+   int port_mask;
+   int data_mask;
+   int base;
+   int lock_mask;
+   int locked;
+} BankRule;
+
+static int page_shift = 16;
+static int page_mask  = 0xffff;
+
+// The page mapped by each window at reset (without a description file,
+// there is a single window, mapping page 0)
+static int window_init[MAX_WINDOWS];
+
+// The shadow page currently mapped by each window (NULL if unknown)
+static ShadowPage *window_shadow[MAX_WINDOWS];
+
+static ShadowPage private_pages[MAX_WINDOWS];
+
+static ShadowPage pages[MAX_PAGES];
+
+static BankRule rules[MAX_RULES];
+
+static int num_rules = 0;
+
+// ===================================================================
+// Description file parsing
+// ===================================================================
+
+static int parse_number(const char *token, int *value) {
+   char *end;
+   long n = strtol(token, &end, 0);
+   if (end == token) {
+      return 1;
+   }
+   if (*end == 'K' || *end == 'k') {
+      n *= 1024;
+      end++;
+   }
+   if (*end || n < 0 || n > 0x10000) {
+      return 1;
+   }
+   *value = (int) n;
+   return 0;
+}
+
+static int parse_keyword_number(const char *keyword, int *value) {
+   char *token = strtok(NULL, " \t\r\n");
+   if (!token || strcmp(token, keyword)) {
+      return 1;
+   }
+   token = strtok(NULL, " \t\r\n");
+   return !token || parse_number(token, value);
+}
+
+static int parse_window(int *window) {
+   int addr;
+   char *token = strtok(NULL, " \t\r\n");
+   if (!token || parse_number(token, &addr) || addr > 0xffff || (addr & page_mask)) {
+      return 1;
+   }
+   *window = addr >> page_shift;
+   return 0;
+}
+
+static int bank_bits(int data_mask) {
+   int bits = 0;
+   while (data_mask) {
+      bits += data_mask & 1;
+      data_mask >>= 1;
+   }
+   return bits;
+}
+
+int memmap_load(const char *filename) {
+   char line[256];
+   int line_num = 0;
+   int have_windows = 0;
+   FILE *stream = fopen(filename, "r");
+   if (!stream) {
+      perror("failed to open memory map file");
+      return 1;
+   }
+   // The default page size when a description file is given
+   page_shift = 14;
+   page_mask  = (1 << page_shift) - 1;
+   for (int i = 0; i < MAX_WINDOWS; i++) {
+      window_init[i] = PAGE_PRIVATE;
+   }
+   num_rules = 0;
+   while (fgets(line, sizeof(line), stream)) {
+      line_num++;
+      char *comment = strchr(line, '#');
+      if (comment) {
+         *comment = '\0';
+      }
+      char *token = strtok(line, " \t\r\n");
+      if (!token) {
+         continue;
+      }
+      int error = 0;
+      if (!strcmp(token, "pagesize")) {
+         int size;
+         token = strtok(NULL, " \t\r\n");
+         if (have_windows || !token || parse_number(token, &size) || size < 256 || (size & (size - 1))) {
+            error = 1;
+         } else {
+            page_shift = 0;
+            while ((1 << page_shift) < size) {
+               page_shift++;
+            }
+            page_mask = size - 1;
+         }
+      } else if (!strcmp(token, "fixed")) {
+         int window;
+         int page;
+         have_windows = 1;
+         if (parse_window(&window) || parse_keyword_number("page", &page) || page >= MAX_PAGES) {
+            error = 1;
+         } else {
+            window_init[window] = page;
+         }
+      } else if (!strcmp(token, "bank")) {
+         BankRule *rule = &rules[num_rules];
+         have_windows = 1;
+         rule->base = 0;
+         rule->lock_mask = 0;
+         if (num_rules == MAX_RULES ||
+             parse_window(&rule->window) ||
+             parse_keyword_number("port", &rule->port) ||
+             parse_keyword_number("mask", &rule->port_mask) ||
+             parse_keyword_number("data", &rule->data_mask) ||
+             rule->data_mask > 0xff) {
+            error = 1;
+         } else {
+            int init = -1;
+            while (!error && (token = strtok(NULL, " \t\r\n"))) {
+               char *value = strtok(NULL, " \t\r\n");
+               if (!strcmp(token, "base") && value) {
+                  error = parse_number(value, &rule->base);
+               } else if (!strcmp(token, "init") && value) {
+                  error = parse_number(value, &init);
+               } else if (!strcmp(token, "lock") && value) {
+                  error = parse_number(value, &rule->lock_mask) || rule->lock_mask > 0xff;
+               } else {
+                  error = 1;
+               }
+            }
+            if (rule->base + (1 << bank_bits(rule->data_mask)) > MAX_PAGES || init >= MAX_PAGES) {
+               error = 1;
+            }
+            if (!error) {
+               window_init[rule->window] = init >= 0 ? init : rule->base;
+               num_rules++;
+            }
+         }
+      } else {
+         error = 1;
+      }
+      if (error) {
+         fprintf(stderr, "%s:%d: invalid memory map directive\n", filename, line_num);
+         fclose(stream);
+         return 1;
+      }
+   }
+   fclose(stream);
+   return 0;
+}
+
+// ===================================================================
+// Page mapping
+// ===================================================================
+
+static void select_page(int window, int page) {
+   if (page == PAGE_UNKNOWN) {
+      window_shadow[window] = NULL;
+   } else if (page == PAGE_PRIVATE) {
+      window_shadow[window] = &private_pages[window];
+   } else {
+      window_shadow[window] = &pages[page];
+   }
+}
+
+static void free_page(ShadowPage *page) {
+   free(page->data);
+   page->data  = NULL;
+   page->valid = NULL;
+}
+
+void memmap_init() {
+   for (int i = 0; i < MAX_WINDOWS; i++) {
+      free_page(&private_pages[i]);
+   }
+   for (int i = 0; i < MAX_PAGES; i++) {
+      free_page(&pages[i]);
+   }
+   memmap_reset();
+}
+
+void memmap_reset() {
+   for (int i = 0; i < (0x10000 >> page_shift); i++) {
+      select_page(i, window_init[i]);
+   }
+   for (int i = 0; i < num_rules; i++) {
+      rules[i].locked = 0;
+   }
+}
+
+void memmap_io_write(int port, int data) {
+   for (int i = 0; i < num_rules; i++) {
+      BankRule *rule = &rules[i];
+      if (rule->locked) {
+         continue;
+      } else if (port < 0 || data < 0) {
+         // The write might have switched this bank, so the mapping becomes
+         // unknown (whether it also set the lock is not known either, so the
+         // window stays unlocked)
+         select_page(rule->window, PAGE_UNKNOWN);
+      } else if (((port ^ rule->port) & rule->port_mask) == 0) {
+         // Pack the selected data bits together to form the bank number
+         int bank = 0;
+         int bit  = 0;
+         int bits = data;
+         for (int mask = rule->data_mask; mask; mask >>= 1, bits >>= 1) {
+            if (mask & 1) {
+               bank |= (bits & 1) << bit++;
+            }
+         }
+         select_page(rule->window, rule->base + bank);
+         rule->locked = (data & rule->lock_mask) != 0;
+      }
+   }
+}
+
+// ===================================================================
+// Shadow memory access
+// ===================================================================
+
+int memmap_read(int ea) {
+   ShadowPage *page = window_shadow[ea >> page_shift];
+   if (!page) {
+      return MEM_UNMAPPED;
+   }
+   if (!page->data) {
+      return MEM_UNKNOWN;
+   }
+   int offset = ea & page_mask;
+   if (!((page->valid[offset >> 3] >> (offset & 7)) & 1)) {
+      return MEM_UNKNOWN;
+   }
+   return page->data[offset];
+}
+
+void memmap_write(int ea, int data) {
+   ShadowPage *page = window_shadow[ea >> page_shift];
+   if (!page) {
+      return;
+   }
+   if (!page->data) {
+      // Allocate the data and the validity bitmap together
+      int size = page_mask + 1;
+      page->data = calloc(size + (size >> 3), 1);
+      if (!page->data) {
+         return;
+      }
+      page->valid = page->data + size;
+   }
+   int offset = ea & page_mask;
+   page->data[offset] = data;
+   page->valid[offset >> 3] |= 1 << (offset & 7);
+}
+
+// Compares a block of n bytes with the shadow memory, starting at ea and
+// stepping by step (+1 or -1). Returns the index of the first byte that
+// differs from a known value, or n if there are none.
+int memmap_compare(int ea, int step, const uint8_t *data, int n) {
+   int i = 0;
+   while (i < n) {
+      int addr = (ea + i * step) & 0xffff;
+      ShadowPage *page = window_shadow[addr >> page_shift];
+      int offset = addr & page_mask;
+      // The number of locations left in this window, in the direction of travel
+      int len = step > 0 ? page_mask + 1 - offset : offset + 1;
+      if (len > n - i) {
+         len = n - i;
+      }
+      if (page && page->data) {
+         for (int j = 0; j < len; j++, offset += step) {
+            if (((page->valid[offset >> 3] >> (offset & 7)) & 1) && page->data[offset] != data[i + j]) {
+               return i + j;
+            }
+         }
+      }
+      i += len;
+   }
+   return n;
+}
+
+// Writes a block of n bytes to the shadow memory, starting at ea and
+// stepping by step (+1 or -1).
+void memmap_write_block(int ea, int step, const uint8_t *data, int n) {
+   for (int i = 0; i < n; i++) {
+      memmap_write((ea + i * step) & 0xffff, data[i]);
+   }
+}
@@ -0,0 +1,21 @@
+#ifndef _INCLUDE_MEMMAP_H
+#define _INCLUDE_MEMMAP_H
+
+#include <stdint.h>
+
+// Returned by memmap_read() when the location has not been seen
+#define MEM_UNKNOWN   -1
+
+// Returned by memmap_read() when the bank mapped at the location is unknown
+#define MEM_UNMAPPED  -2
+
+int  memmap_load(const char *filename);
+void memmap_init();
+void memmap_reset();
+int  memmap_read(int ea);
+void memmap_write(int ea, int data);
+void memmap_io_write(int port, int data);
+int  memmap_compare(int ea, int step, const uint8_t *data, int n);
+void memmap_write_block(int ea, int step, const uint8_t *data, int n);
+
+#endif
@@ -0,0 +1,116 @@
+//
+// Merges the memory images written by decodez80 --dump-memory
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <argp.h>
+#include "memimage.h"
+
+const char *argp_program_version = "memmerge 0.1";
+
+const char *argp_program_bug_address = "<dave@hoglet.com>";
+
+static char doc[] = "\n\
+Merges the memory images written by decodez80 --dump-memory. Where the\n\
+images disagree, the earliest file given wins.\n\
+\n\
+";
+
+static char args_doc[] = "FILENAME...";
+
+static struct argp_option options[] = {
+   { "output",       'o',   "FILE",                   0, "Write the merged image to FILE"},
+   { "binary",       'b',   "FILE",                   0, "Write the merged image to FILE as a raw 64K binary"},
+   { "fill",         'f',   "BYTE",                   0, "The value written to the raw binary for unknown bytes (default 0xFF)"},
+   { "report",       'r',   "FILE",                   0, "Write a report of the known address ranges to FILE (- for stdout)"},
+   { 0 }
+};
+
+struct arguments {
+   char *output;
+   char *binary;
+   int fill;
+   char *report;
+   char **files;
+   int num_files;
+} arguments;
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state) {
+   struct arguments *arguments = state->input;
+
+   switch (key) {
+   case 'o':
+      arguments->output = arg;
+      break;
+   case 'b':
+      arguments->binary = arg;
+      break;
+   case 'f':
+      arguments->fill = strtol(arg, NULL, 0) & 0xff;
+      break;
+   case 'r':
+      arguments->report = arg;
+      break;
+   case ARGP_KEY_ARGS:
+      arguments->files = state->argv + state->next;
+      arguments->num_files = state->argc - state->next;
+      break;
+   case ARGP_KEY_NO_ARGS:
+      argp_usage(state);
+      break;
+   default:
+      return ARGP_ERR_UNKNOWN;
+   }
+   return 0;
+}
+
+static struct argp argp = { options, parse_opt, args_doc, doc, 0, 0, 0 };
+
+static MemImageType merged;
+
+static MemImageType image;
+
+int main(int argc, char *argv[]) {
+   arguments.output    = NULL;
+   arguments.binary    = NULL;
+   arguments.fill      = 0xff;
+   arguments.report    = NULL;
+   arguments.files     = NULL;
+   arguments.num_files = 0;
+   argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+   for (int i = 0; i < arguments.num_files; i++) {
+      if (memimage_load(arguments.files[i], &image)) {
+         return 2;
+      }
+      int conflicts = memimage_merge(&merged, &image);
+      if (conflicts) {
+         fprintf(stderr, "%s: %d bytes differ from earlier images\n", arguments.files[i], conflicts);
+      }
+   }
+
+   if (arguments.output && memimage_save(arguments.output, &merged)) {
+      return 2;
+   }
+
+   if (arguments.binary && memimage_save_binary(arguments.binary, &merged, arguments.fill)) {
+      return 2;
+   }
+
+   if (arguments.report && strcmp(arguments.report, "-")) {
+      FILE *stream = fopen(arguments.report, "w");
+      if (!stream) {
+         perror("failed to open report file");
+         return 2;
+      }
+      memimage_report(stream, &merged);
+      fclose(stream);
+   } else if (arguments.report || (!arguments.output && !arguments.binary)) {
+      // Report to stdout by default
+      memimage_report(stdout, &merged);
+   }
+
+   return 0;
+}
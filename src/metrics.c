@@ -0,0 +1,200 @@
+//
+// Time series metrics
+//
+// The capture is divided into fixed windows, of a number of T-states
+// (counted from the start of the capture) or of samples, and for each
+// window the instructions, T-states, idle T-states (halted, or executing
+// in one of the idle ranges given), interrupts, bus cycles by type and
+// wait states are counted. Each instruction is counted in the window in
+// which it starts. Windows in which nothing started (e.g. during a reset)
+// are written as zeros, so that the rows are evenly spaced in time.
+//
+// Rows are written as each window ends, so the memory used doesn't grow
+// with the length of the capture.
+//
+// The output is CSV if the filename ends in .csv, and otherwise binary:
+// an 8 byte header ("Z80MET01"), the window length (64 bits) and unit
+// (32 bits, 0 for T-states or 1 for samples) and number of columns (32
+// bits), followed by one record per window of that many 32 bit columns
+// (in the order of the CSV columns, after the window start). All values
+// are little endian, and counts saturate at 0xFFFFFFFF.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <inttypes.h>
+#include "metrics.h"
+
+#define MAX_IDLE_RANGES 64
+
+#define COL_INSTRUCTIONS 0
+#define COL_TSTATES      1
+#define COL_IDLE         2
+#define COL_INTERRUPTS   3
+#define COL_BUS          4   // METRICS_NUM_BUS columns
+#define COL_WAIT         (COL_BUS + METRICS_NUM_BUS)
+#define NUM_COLUMNS      (COL_WAIT + 1)
+
+static const char magic[8] = { 'Z', '8', '0', 'M', 'E', 'T', '0', '1' };
+
+static struct {
+   int start;
+   int end;
+} idle_ranges[MAX_IDLE_RANGES];
+
+static int num_idle_ranges = 0;
+
+static uint8_t idle_map[0x10000];
+
+static uint64_t window = 100000;
+static int unit = METRICS_TSTATES;
+
+static FILE *stream = NULL;
+static int csv;
+
+// The current window
+static uint64_t window_num = 0;
+static uint64_t window_end;
+static uint64_t columns[NUM_COLUMNS];
+
+// T-states from the start of the capture
+static uint64_t tstates = 0;
+
+int metrics_add_idle(const char *spec) {
+   char *end;
+   if (num_idle_ranges == MAX_IDLE_RANGES) {
+      return 1;
+   }
+   int start = strtol(spec, &end, 0);
+   if (end == spec || *end != '-') {
+      return 1;
+   }
+   spec = end + 1;
+   int last = strtol(spec, &end, 0);
+   if (end == spec || *end || start < 0 || last > 0xffff || start > last) {
+      return 1;
+   }
+   idle_ranges[num_idle_ranges].start = start;
+   idle_ranges[num_idle_ranges].end   = last;
+   num_idle_ranges++;
+   return 0;
+}
+
+// Sets the window length, as a number of T-states or with an s suffix a
+// number of samples
+int metrics_set_window(const char *spec) {
+   char *end;
+   long long n = strtoll(spec, &end, 0);
+   if (end == spec || n <= 0) {
+      return 1;
+   }
+   if (*end == 's') {
+      unit = METRICS_SAMPLES;
+      end++;
+   } else {
+      unit = METRICS_TSTATES;
+   }
+   if (*end) {
+      return 1;
+   }
+   window = n;
+   return 0;
+}
+
+static void put_u32(uint8_t *buffer, uint64_t value) {
+   if (value > 0xffffffff) {
+      value = 0xffffffff;
+   }
+   for (int i = 0; i < 4; i++) {
+      buffer[i] = (value >> (i * 8)) & 0xff;
+   }
+}
+
+static void put_u64(uint8_t *buffer, uint64_t value) {
+   for (int i = 0; i < 8; i++) {
+      buffer[i] = (value >> (i * 8)) & 0xff;
+   }
+}
+
+int metrics_open(const char *filename) {
+   stream = fopen(filename, "wb");
+   if (!stream) {
+      perror("failed to open metrics file");
+      return 1;
+   }
+   for (int i = 0; i < num_idle_ranges; i++) {
+      memset(idle_map + idle_ranges[i].start, 1, idle_ranges[i].end - idle_ranges[i].start + 1);
+   }
+   int len = strlen(filename);
+   csv = len >= 4 && !strcasecmp(filename + len - 4, ".csv");
+   if (csv) {
+      fprintf(stream, "%s,instructions,tstates,idle_tstates,busy_pct,interrupts,fetches,mem_reads,mem_writes,io_reads,io_writes,wait_states\n",
+              unit == METRICS_SAMPLES ? "sample" : "tstate");
+   } else {
+      uint8_t header[24];
+      memcpy(header, magic, sizeof(magic));
+      put_u64(header + 8, window);
+      put_u32(header + 16, unit);
+      put_u32(header + 20, NUM_COLUMNS);
+      fwrite(header, sizeof(header), 1, stream);
+   }
+   window_end = window;
+   return 0;
+}
+
+static void write_window() {
+   if (csv) {
+      uint64_t busy = columns[COL_TSTATES] > columns[COL_IDLE] ? columns[COL_TSTATES] - columns[COL_IDLE] : 0;
+      fprintf(stream, "%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%.1f",
+              window_num * window, columns[COL_INSTRUCTIONS], columns[COL_TSTATES], columns[COL_IDLE],
+              columns[COL_TSTATES] ? busy * 100.0 / columns[COL_TSTATES] : 0.0);
+      for (int i = COL_INTERRUPTS; i < NUM_COLUMNS; i++) {
+         fprintf(stream, ",%" PRIu64, columns[i]);
+      }
+      fprintf(stream, "\n");
+   } else {
+      uint8_t record[NUM_COLUMNS * 4];
+      for (int i = 0; i < NUM_COLUMNS; i++) {
+         put_u32(record + i * 4, columns[i]);
+      }
+      fwrite(record, sizeof(record), 1, stream);
+   }
+   memset(columns, 0, sizeof(columns));
+   window_num++;
+   window_end += window;
+}
+
+// Records an instruction (at pc, or -1 if unknown) which started at the
+// given sample. The NOPs executed while halted are passed with halted set.
+void metrics_instruction(uint64_t sample, int pc, int instr_cycles, int wait_cycles, int halted, int interrupt, const int *bus) {
+   uint64_t position = unit == METRICS_SAMPLES ? sample : tstates;
+   while (position >= window_end) {
+      write_window();
+   }
+   tstates += instr_cycles;
+   if (!halted) {
+      columns[COL_INSTRUCTIONS]++;
+   }
+   columns[COL_TSTATES] += instr_cycles;
+   if (halted || (pc >= 0 && idle_map[pc])) {
+      columns[COL_IDLE] += instr_cycles;
+   }
+   if (interrupt) {
+      columns[COL_INTERRUPTS]++;
+   }
+   for (int i = 0; i < METRICS_NUM_BUS; i++) {
+      columns[COL_BUS + i] += bus[i];
+   }
+   columns[COL_WAIT] += wait_cycles;
+}
+
+// Writes the last (partial) window and closes the file
+int metrics_close() {
+   write_window();
+   if (fclose(stream)) {
+      perror("failed to write metrics file");
+      return 1;
+   }
+   return 0;
+}
@@ -0,0 +1,24 @@
+#ifndef _INCLUDE_METRICS_H
+#define _INCLUDE_METRICS_H
+
+#include <stdint.h>
+
+// Units of the window length
+#define METRICS_TSTATES 0
+#define METRICS_SAMPLES 1
+
+// Bus cycle counts passed for each instruction
+#define METRICS_FETCH     0
+#define METRICS_MEM_READ  1
+#define METRICS_MEM_WRITE 2
+#define METRICS_IO_READ   3
+#define METRICS_IO_WRITE  4
+#define METRICS_NUM_BUS   5
+
+int  metrics_add_idle(const char *spec);
+int  metrics_set_window(const char *spec);
+int  metrics_open(const char *filename);
+void metrics_instruction(uint64_t sample, int pc, int instr_cycles, int wait_cycles, int halted, int interrupt, const int *bus);
+int  metrics_close();
+
+#endif
@@ -0,0 +1,131 @@
+//
+// Flat profiler of the target program
+//
+// The execution count, T-states and wait states of each instruction are
+// accumulated against its PC. At exit, the hottest addresses are listed
+// in T-state order, followed by an annotated listing of every address
+// executed. Interrupt acknowledges, and instructions executed while the
+// PC is unknown, are accumulated separately.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include "profile.h"
+
+#define NUM_ADDRS (PROFILE_NMI + 1)
+
+static uint64_t pc_count[NUM_ADDRS];
+static uint64_t pc_cycles[NUM_ADDRS];
+static uint64_t pc_wait[NUM_ADDRS];
+
+// Returns non-zero the first time an instruction is seen at pc
+int profile_instruction(int pc, int instr_cycles, int wait_cycles) {
+   pc_cycles[pc] += instr_cycles;
+   pc_wait[pc]   += wait_cycles;
+   return pc_count[pc]++ == 0;
+}
+
+// ===================================================================
+// Output
+// ===================================================================
+
+static int compare_cycles(const void *a, const void *b) {
+   uint64_t ca = pc_cycles[*(const int *)a];
+   uint64_t cb = pc_cycles[*(const int *)b];
+   if (ca != cb) {
+      return ca < cb ? 1 : -1;
+   }
+   return *(const int *)a - *(const int *)b;
+}
+
+static void write_addr(FILE *stream, int pc) {
+   switch (pc) {
+   case PROFILE_UNKNOWN:
+      fprintf(stream, "????");
+      break;
+   case PROFILE_INT:
+      fprintf(stream, "INT ");
+      break;
+   case PROFILE_NMI:
+      fprintf(stream, "NMI ");
+      break;
+   default:
+      fprintf(stream, "%04X", pc);
+      break;
+   }
+}
+
+// Returns the length of the instruction at pc (zero for a pseudo-address)
+static int write_line(FILE *stream, int pc, uint64_t total, ProfileDisassembler disassemble) {
+   int len = 0;
+   write_addr(stream, pc);
+   fprintf(stream, " : %12" PRIu64 " %14" PRIu64 " %12" PRIu64 " %6.2f%%",
+           pc_count[pc], pc_cycles[pc], pc_wait[pc],
+           total ? 100.0 * (double) pc_cycles[pc] / (double) total : 0.0);
+   if (pc < 0x10000) {
+      fprintf(stream, " : ");
+      len = disassemble(stream, pc);
+   }
+   fprintf(stream, "\n");
+   return len;
+}
+
+static void write_header(FILE *stream) {
+   fprintf(stream, "Addr :        Count       T-states         Wait   Share\n");
+}
+
+int profile_write(const char *filename, int top_n, ProfileDisassembler disassemble) {
+   FILE *stream = fopen(filename, "w");
+   if (!stream) {
+      perror("failed to open profile file");
+      return 1;
+   }
+   int *order = malloc(NUM_ADDRS * sizeof(int));
+   if (!order) {
+      fclose(stream);
+      return 1;
+   }
+   int n = 0;
+   uint64_t total_count = 0;
+   uint64_t total_cycles = 0;
+   uint64_t total_wait = 0;
+   for (int pc = 0; pc < NUM_ADDRS; pc++) {
+      if (pc_count[pc]) {
+         order[n++] = pc;
+         total_count  += pc_count[pc];
+         total_cycles += pc_cycles[pc];
+         total_wait   += pc_wait[pc];
+      }
+   }
+   fprintf(stream, "Total: %" PRIu64 " instructions, %" PRIu64 " T-states, %" PRIu64 " wait states, %d addresses\n",
+           total_count, total_cycles, total_wait, n);
+
+   // The hottest addresses, by T-states
+   qsort(order, n, sizeof(int), compare_cycles);
+   if (top_n > n) {
+      top_n = n;
+   }
+   fprintf(stream, "\nTop %d addresses:\n\n", top_n);
+   write_header(stream);
+   for (int i = 0; i < top_n; i++) {
+      write_line(stream, order[i], total_cycles, disassemble);
+   }
+
+   // Every address in order, with a gap where execution is not contiguous
+   fprintf(stream, "\nListing:\n\n");
+   write_header(stream);
+   int next = -1;
+   for (int pc = 0; pc < NUM_ADDRS; pc++) {
+      if (pc_count[pc]) {
+         if (next >= 0 && pc != next) {
+            fprintf(stream, "\n");
+         }
+         int len = write_line(stream, pc, total_cycles, disassemble);
+         // An instruction with no bytes (e.g. while halted) still occupies its address
+         next = pc + (len ? len : 1);
+      }
+   }
+   free(order);
+   fclose(stream);
+   return 0;
+}
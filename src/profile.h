@@ -0,0 +1,18 @@
+#ifndef _INCLUDE_PROFILE_H
+#define _INCLUDE_PROFILE_H
+
+#include <stdio.h>
+
+// Pseudo-addresses for instructions that are not attributed to a PC
+#define PROFILE_UNKNOWN 0x10000
+#define PROFILE_INT     0x10001
+#define PROFILE_NMI     0x10002
+
+// Writes the disassembly of the instruction at pc, without a newline,
+// returning its length in bytes
+typedef int (*ProfileDisassembler)(FILE *stream, int pc);
+
+int  profile_instruction(int pc, int instr_cycles, int wait_cycles);
+int  profile_write(const char *filename, int top_n, ProfileDisassembler disassemble);
+
+#endif
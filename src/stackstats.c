@@ -0,0 +1,191 @@
+//
+// Stack usage profiler
+//
+// Tracks the deepest SP reached (the stack high-water mark) over the whole
+// capture, and separately for each root of the call graph: the main
+// program, and each interrupt handler (by type and handler address). The
+// PC of the instruction that reached each mark is recorded, with the time
+// in T-states from the start of the capture.
+//
+// Interrupt service frames are followed in the same way as the interrupt
+// statistics, and for each handler the stack used is also given relative
+// to the SP at the acknowledge (so includes the pushed return address).
+//
+// The output is CSV if the filename ends in .csv, and otherwise JSON.
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <inttypes.h>
+#include "callgraph.h"
+#include "stackstats.h"
+
+#define MAX_ROOTS   64
+
+#define MAX_NESTING 64
+
+typedef struct {
+   int kind;
+   int vector;
+   uint64_t entries;
+   int min_key;
+   int pc;
+   uint64_t time;
+   int max_used;
+} RootType;
+
+// The overall mark, then the main program, then each handler
+static RootType roots[MAX_ROOTS + 2] = {
+   { CG_ROOT, -1 },
+   { CG_ROOT, -1 }
+};
+static int num_roots = 2;
+
+static ShadowFrameType frames[MAX_NESTING];
+static int frame_roots[MAX_NESTING];
+static int depth = 0;
+
+static uint64_t now = 0;
+
+static int find_root(int kind, int vector) {
+   for (int i = 2; i < num_roots; i++) {
+      if (roots[i].kind == kind && roots[i].vector == vector) {
+         return i;
+      }
+   }
+   if (num_roots == MAX_ROOTS + 2) {
+      return -1;
+   }
+   roots[num_roots].kind   = kind;
+   roots[num_roots].vector = vector;
+   return num_roots++;
+}
+
+static void update_mark(int root, int key, int pc, uint64_t time) {
+   RootType *r = &roots[root];
+   if (!r->min_key || key < r->min_key) {
+      r->min_key = key;
+      r->pc      = pc;
+      r->time    = time;
+   }
+}
+
+void stackstats_instruction(int kind, int target, int return_addr, int pc, int sp, int instr_cycles) {
+   uint64_t start = now;
+   now += instr_cycles;
+   if (kind == CG_INT || kind == CG_NMI) {
+      int root = find_root(kind, target);
+      if (root >= 0 && depth < MAX_NESTING) {
+         roots[root].entries++;
+         frame_roots[depth]        = root;
+         frames[depth].return_addr = return_addr;
+         frames[depth].sp          = sp;
+         depth++;
+      }
+   } else {
+      // End the service frames whose return address has been popped
+      depth = shadow_stack_depth(frames, depth, kind, target, sp);
+   }
+   if (sp < 0) {
+      return;
+   }
+   int key = STACK_KEY(sp);
+   update_mark(0, key, pc, start);
+   if (depth) {
+      ShadowFrameType *frame = &frames[depth - 1];
+      int root = frame_roots[depth - 1];
+      update_mark(root, key, pc, start);
+      // Relative to the SP before the return address was pushed
+      if (frame->sp >= 0) {
+         int used = STACK_KEY(frame->sp) + 2 - key;
+         if (used > roots[root].max_used) {
+            roots[root].max_used = used;
+         }
+      }
+   } else {
+      update_mark(1, key, pc, start);
+   }
+}
+
+// ===================================================================
+// Output
+// ===================================================================
+
+static const char *root_name(int i) {
+   if (i == 0) {
+      return "all";
+   } else if (i == 1) {
+      return "main";
+   } else {
+      return roots[i].kind == CG_NMI ? "NMI" : "INT";
+   }
+}
+
+// Returns the address as a JSON string, or null if it is unknown (-1)
+static const char *json_address(char *buffer, int addr) {
+   if (addr < 0) {
+      return "null";
+   }
+   sprintf(buffer, "\"%04X\"", addr);
+   return buffer;
+}
+
+int stackstats_write(const char *filename) {
+   FILE *stream = fopen(filename, "w");
+   if (!stream) {
+      perror("failed to open stack statistics file");
+      return 1;
+   }
+   int len = strlen(filename);
+   int csv = len >= 4 && !strcasecmp(filename + len - 4, ".csv");
+   if (csv) {
+      fprintf(stream, "root,vector,entries,min_sp,pc,time,max_used\n");
+   } else {
+      fprintf(stream, "{\n  \"roots\": [");
+   }
+   int first = 1;
+   for (int i = 0; i < num_roots; i++) {
+      RootType *r = &roots[i];
+      int min_sp = r->min_key ? r->min_key & 0xffff : -1;
+      int pc = r->min_key ? r->pc : -1;
+      if (min_sp < 0 && i < 2) {
+         // No known SP was seen
+         continue;
+      }
+      if (csv) {
+         char vector[16] = "";
+         char min_sp_text[16] = "";
+         char pc_text[16] = "";
+         if (r->vector >= 0) {
+            sprintf(vector, "%04X", r->vector);
+         }
+         if (min_sp >= 0) {
+            sprintf(min_sp_text, "%04X", min_sp);
+            if (pc >= 0) {
+               sprintf(pc_text, "%04X", pc);
+            } else {
+               sprintf(pc_text, "????");
+            }
+         }
+         fprintf(stream, "%s,%s,%" PRIu64 ",%s,%s,%" PRIu64 ",", root_name(i), vector, r->entries, min_sp_text, pc_text, r->time);
+         if (i >= 2) {
+            fprintf(stream, "%d", r->max_used);
+         }
+         fprintf(stream, "\n");
+      } else {
+         char buffer[16];
+         fprintf(stream, "%s\n    {\"root\": \"%s\", ", first ? "" : ",", root_name(i));
+         if (i >= 2) {
+            fprintf(stream, "\"vector\": %s, \"entries\": %" PRIu64 ", \"max_used\": %d, ", json_address(buffer, r->vector), r->entries, r->max_used);
+         }
+         fprintf(stream, "\"min_sp\": %s, ", json_address(buffer, min_sp));
+         fprintf(stream, "\"pc\": %s, \"time\": %" PRIu64 "}", json_address(buffer, pc), r->time);
+      }
+      first = 0;
+   }
+   if (!csv) {
+      fprintf(stream, "\n  ]\n}\n");
+   }
+   fclose(stream);
+   return 0;
+}
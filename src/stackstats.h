@@ -0,0 +1,8 @@
+#ifndef _INCLUDE_STACKSTATS_H
+#define _INCLUDE_STACKSTATS_H
+
+// pc is the address of the instruction, and sp the value after it executed
+void stackstats_instruction(int kind, int target, int return_addr, int pc, int sp, int instr_cycles);
+int  stackstats_write(const char *filename);
+
+#endif
@@ -0,0 +1,186 @@
+//
+// Per-instruction statistics, collected instead of the disassembly
+//
+// For each (prefix, opcode) pair, and for INT and NMI acknowledges, this
+// records the number of executions, the total T-states and wait states,
+// the range of T-states per execution and the number of each kind of
+// emulation failure. The statistics are written at exit, as CSV if the
+// filename ends in .csv, and otherwise as JSON.
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <inttypes.h>
+#include "stats.h"
+
+// Interrupts are recorded after the seven opcode tables
+#define INDEX_INT    (NUM_INSTR_INDEX)
+#define INDEX_NMI    (NUM_INSTR_INDEX + 1)
+#define NUM_INDEX    (NUM_INSTR_INDEX + 2)
+
+#define NUM_FAIL_BITS 4
+
+typedef struct {
+   uint64_t count;
+   uint64_t cycles;
+   uint64_t wait_cycles;
+   int min_cycles;
+   int max_cycles;
+   uint64_t fail[NUM_FAIL_BITS];
+} InstrStatsType;
+
+static InstrStatsType stats[NUM_INDEX];
+
+// The prefix of each table, in z80_instr_index() order
+static const int prefixes[] = { 0x00, 0xCB, 0xED, 0xDD, 0xFD, 0xDDCB, 0xFDCB };
+
+static const char *fail_names[NUM_FAIL_BITS] = {
+   "error",
+   "memory",
+   "not_implemented",
+   "implementation_error"
+};
+
+static int stats_index(const InstrType *instr, int prefix, int opcode) {
+   if (instr == &z80_interrupt_int) {
+      return INDEX_INT;
+   } else if (instr == &z80_interrupt_nmi) {
+      return INDEX_NMI;
+   } else {
+      return z80_instr_index(prefix, opcode);
+   }
+}
+
+void stats_instruction(const InstrType *instr, int prefix, int opcode, int instr_cycles, int wait_cycles) {
+   InstrStatsType *s = &stats[stats_index(instr, prefix, opcode)];
+   if (s->count == 0 || instr_cycles < s->min_cycles) {
+      s->min_cycles = instr_cycles;
+   }
+   if (instr_cycles > s->max_cycles) {
+      s->max_cycles = instr_cycles;
+   }
+   s->count++;
+   s->cycles      += instr_cycles;
+   s->wait_cycles += wait_cycles;
+}
+
+void stats_fail(const InstrType *instr, int prefix, int opcode, int failflag) {
+   InstrStatsType *s = &stats[stats_index(instr, prefix, opcode)];
+   for (int i = 0; i < NUM_FAIL_BITS; i++) {
+      if (failflag & (1 << i)) {
+         s->fail[i]++;
+      }
+   }
+}
+
+// ===================================================================
+// Output
+// ===================================================================
+
+// Returns the generic form of the instruction (e.g. "LD BC,nn"), which is
+// valid until the next call
+static const char *index_mnemonic(int index) {
+   static char name[32];
+   if (index == INDEX_INT) {
+      return "INT";
+   } else if (index == INDEX_NMI) {
+      return "NMI";
+   } else {
+      int prefix = prefixes[index >> 8];
+      z80_instr_name(name, sizeof(name), &table_by_prefix(prefix)[index & 0xff], prefix);
+      return name;
+   }
+}
+
+static void index_prefix_opcode(int index, char *prefix, char *opcode) {
+   if (index >= NUM_INSTR_INDEX) {
+      *prefix = '\0';
+      *opcode = '\0';
+   } else {
+      sprintf(prefix, "%02X", prefixes[index >> 8]);
+      sprintf(opcode, "%02X", index & 0xff);
+   }
+}
+
+static double mean_cycles(InstrStatsType *s) {
+   return (double) s->cycles / (double) s->count;
+}
+
+static void write_csv(FILE *stream) {
+   char prefix[8];
+   char opcode[8];
+   fprintf(stream, "prefix,opcode,mnemonic,count,cycles,wait_cycles,min_cycles,max_cycles,mean_cycles");
+   for (int i = 0; i < NUM_FAIL_BITS; i++) {
+      fprintf(stream, ",fail_%s", fail_names[i]);
+   }
+   fprintf(stream, "\n");
+   for (int index = 0; index < NUM_INDEX; index++) {
+      InstrStatsType *s = &stats[index];
+      if (s->count == 0) {
+         continue;
+      }
+      index_prefix_opcode(index, prefix, opcode);
+      fprintf(stream, "%s,%s,\"%s\",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%d,%d,%.3f",
+              prefix, opcode, index_mnemonic(index),
+              s->count, s->cycles, s->wait_cycles,
+              s->min_cycles, s->max_cycles, mean_cycles(s));
+      for (int i = 0; i < NUM_FAIL_BITS; i++) {
+         fprintf(stream, ",%" PRIu64, s->fail[i]);
+      }
+      fprintf(stream, "\n");
+   }
+}
+
+static void write_json(FILE *stream) {
+   char prefix[8];
+   char opcode[8];
+   uint64_t count = 0;
+   uint64_t cycles = 0;
+   uint64_t wait_cycles = 0;
+   for (int index = 0; index < NUM_INDEX; index++) {
+      count       += stats[index].count;
+      cycles      += stats[index].cycles;
+      wait_cycles += stats[index].wait_cycles;
+   }
+   fprintf(stream, "{\n");
+   fprintf(stream, "  \"instructions\": %" PRIu64 ",\n", count);
+   fprintf(stream, "  \"cycles\": %" PRIu64 ",\n", cycles);
+   fprintf(stream, "  \"wait_cycles\": %" PRIu64 ",\n", wait_cycles);
+   fprintf(stream, "  \"opcodes\": [");
+   int first = 1;
+   for (int index = 0; index < NUM_INDEX; index++) {
+      InstrStatsType *s = &stats[index];
+      if (s->count == 0) {
+         continue;
+      }
+      index_prefix_opcode(index, prefix, opcode);
+      fprintf(stream, "%s\n    {\"prefix\": \"%s\", \"opcode\": \"%s\", \"mnemonic\": \"%s\", ",
+              first ? "" : ",", prefix, opcode, index_mnemonic(index));
+      fprintf(stream, "\"count\": %" PRIu64 ", \"cycles\": %" PRIu64 ", \"wait_cycles\": %" PRIu64 ", ",
+              s->count, s->cycles, s->wait_cycles);
+      fprintf(stream, "\"min_cycles\": %d, \"max_cycles\": %d, \"mean_cycles\": %.3f, \"fail\": {",
+              s->min_cycles, s->max_cycles, mean_cycles(s));
+      for (int i = 0; i < NUM_FAIL_BITS; i++) {
+         fprintf(stream, "%s\"%s\": %" PRIu64, i ? ", " : "", fail_names[i], s->fail[i]);
+      }
+      fprintf(stream, "}}");
+      first = 0;
+   }
+   fprintf(stream, "\n  ]\n}\n");
+}
+
+int stats_write(const char *filename) {
+   FILE *stream = fopen(filename, "w");
+   if (!stream) {
+      perror("failed to open statistics file");
+      return 1;
+   }
+   int len = strlen(filename);
+   if (len >= 4 && !strcasecmp(filename + len - 4, ".csv")) {
+      write_csv(stream);
+   } else {
+      write_json(stream);
+   }
+   fclose(stream);
+   return 0;
+}
@@ -0,0 +1,10 @@
+#ifndef _INCLUDE_STATS_H
+#define _INCLUDE_STATS_H
+
+#include "em_z80.h"
+
+void stats_instruction(const InstrType *instr, int prefix, int opcode, int instr_cycles, int wait_cycles);
+void stats_fail(const InstrType *instr, int prefix, int opcode, int failflag);
+int  stats_write(const char *filename);
+
+#endif
@@ -0,0 +1,116 @@
+//
+// Symbol table for annotating the disassembly
+//
+// Symbols are held in a direct mapped table with one entry per address,
+// so a lookup is a single array access. Where several symbols share an
+// address, the first one loaded is used.
+//
+// The file format is detected line by line, and lines that are not
+// understood are ignored. Anything after a ; is a comment. Supported are:
+//
+//   name = value          plain lists, and z80asm/z88dk .sym and .map files
+//   name: EQU value       sjasmplus and z80asm .sym files
+//   address name          .map files, optionally with a bank (bank:address)
+//
+// Values may be hex ($, #, 0x prefix or h suffix) or otherwise decimal.
+// In the address-first form the address is always four hex digits, and
+// the bank is hex, so that other text (e.g. "ADD A") is not taken for a
+// symbol.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "symbols.h"
+
+#define MAX_TOKENS 8
+
+static char *symbol_table[0x10000];
+
+static int parse_value(const char *token, int base, int *value) {
+   char buffer[32];
+   int len = strlen(token);
+   if (len == 0 || len >= sizeof(buffer)) {
+      return 1;
+   }
+   strcpy(buffer, token);
+   char *digits = buffer;
+   if (*digits == '$' || *digits == '#') {
+      digits++;
+      base = 16;
+   } else if (!strncasecmp(digits, "0x", 2)) {
+      digits += 2;
+      base = 16;
+   } else if (len > 1 && (buffer[len - 1] == 'h' || buffer[len - 1] == 'H')) {
+      buffer[len - 1] = '\0';
+      base = 16;
+   }
+   char *end;
+   long n = strtol(digits, &end, base);
+   if (end == digits || *end || n < 0) {
+      return 1;
+   }
+   *value = n;
+   return 0;
+}
+
+// Whether the token is between one and digits hex digits, with no prefix
+static int hex_digits(const char *token, int digits) {
+   int len = strspn(token, "0123456789ABCDEFabcdef");
+   return len > 0 && len <= digits && !token[len];
+}
+
+static int valid_name(const char *name) {
+   return isalpha((unsigned char) *name) || strchr("_.@?", *name);
+}
+
+static void add_symbol(const char *name, int addr) {
+   if (addr <= 0xffff && valid_name(name) && !symbol_table[addr]) {
+      symbol_table[addr] = strdup(name);
+   }
+}
+
+int symbols_load(const char *filename) {
+   char line[1024];
+   char *tokens[MAX_TOKENS];
+   FILE *stream = fopen(filename, "r");
+   if (!stream) {
+      return 1;
+   }
+   while (fgets(line, sizeof(line), stream)) {
+      char *comment = strchr(line, ';');
+      if (comment) {
+         *comment = '\0';
+      }
+      int assign = strchr(line, '=') != NULL;
+      int bank = strchr(line, ':') != NULL;
+      int n = 0;
+      for (char *token = strtok(line, " \t\r\n:="); token && n < MAX_TOKENS; token = strtok(NULL, " \t\r\n:=")) {
+         tokens[n++] = token;
+      }
+      int value;
+      if (n >= 3 && !strcasecmp(tokens[1], "equ")) {
+         // name: EQU value
+         if (!parse_value(tokens[2], 10, &value)) {
+            add_symbol(tokens[0], value);
+         }
+      } else if (assign) {
+         // name = value
+         if (n >= 2 && !parse_value(tokens[1], 10, &value)) {
+            add_symbol(tokens[0], value);
+         }
+      } else if (n == 2 + bank && strlen(tokens[bank]) == 4 && hex_digits(tokens[bank], 4) && (!bank || hex_digits(tokens[0], 4))) {
+         // [bank:]address name
+         if (!parse_value(tokens[bank], 16, &value)) {
+            add_symbol(tokens[bank + 1], value);
+         }
+      }
+   }
+   fclose(stream);
+   return 0;
+}
+
+const char *symbols_lookup(int addr) {
+   return symbol_table[addr & 0xffff];
+}
@@ -0,0 +1,7 @@
+#ifndef _INCLUDE_SYMBOLS_H
+#define _INCLUDE_SYMBOLS_H
+
+int         symbols_load(const char *filename);
+const char *symbols_lookup(int addr);
+
+#endif
@@ -0,0 +1,187 @@
+//
+// Timeline output in Chrome trace event format
+//
+// Functions and interrupt handlers are written as nested begin/end
+// events, following the CALLs, RSTs and interrupts in the same way as the
+// call graph (a frame ends when the stack slot holding its return address
+// is popped). Periods spent halted, and the iterations of a repeating
+// block instruction (e.g. LDIR) at one address, are also written as
+// events.
+//
+// The effect of each instruction on the call stack is applied at the start
+// of the next instruction, so a call begins and a return ends at the time
+// the instruction completes.
+//
+// Timestamps are in microseconds from the start of the capture when the
+// sample rate is known, and otherwise are T-states from the start of the
+// capture (so the viewer shows 1us per T-state).
+//
+// Events are written as they happen, so the memory used doesn't grow with
+// the length of the capture. The file can be loaded in chrome://tracing or
+// https://ui.perfetto.dev.
+
+#include <stdio.h>
+#include <inttypes.h>
+#include "callgraph.h"
+#include "trace.h"
+
+#define MAX_TRACE_DEPTH 1024
+
+static FILE *stream = NULL;
+static double samplerate;
+static TraceSymbolLookup lookup;
+static int num_events = 0;
+
+static ShadowFrameType frames[MAX_TRACE_DEPTH];
+static int depth = 0;
+
+// Frames beyond the maximum depth, which have no events
+static int overflow = 0;
+
+// The previous instruction, whose effect is applied at the next one
+static int prev_kind = CG_OTHER;
+static int prev_target;
+static int prev_return_addr;
+static int prev_sp = -1;
+
+// The open halt and block instruction events
+static int halted_open = 0;
+static int block_pc = -1;
+static const char *block_name;
+
+// T-states from the start of the capture, and the current time
+static uint64_t tstates = 0;
+static uint64_t now_sample = 0;
+
+static void write_string(const char *s) {
+   fputc('"', stream);
+   for (; *s; s++) {
+      if (*s == '"' || *s == '\\') {
+         fputc('\\', stream);
+      }
+      fputc(*s, stream);
+   }
+   fputc('"', stream);
+}
+
+static void write_event(const char *name, const char *cat, char phase) {
+   fprintf(stream, "%s\n{\"name\":", num_events++ ? "," : "");
+   write_string(name);
+   fprintf(stream, ",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":", cat, phase);
+   if (samplerate > 0) {
+      fprintf(stream, "%.3f", now_sample * 1e6 / samplerate);
+   } else {
+      fprintf(stream, "%" PRIu64, tstates);
+   }
+   fprintf(stream, ",\"pid\":1,\"tid\":1}");
+}
+
+static void begin_frame(int kind, int fn, int return_addr, int sp) {
+   char buffer[16];
+   const char *name = fn >= 0 && lookup ? lookup(fn) : NULL;
+   if (depth == MAX_TRACE_DEPTH) {
+      overflow++;
+      return;
+   }
+   if (!name) {
+      const char *prefix = kind == CG_INT ? "int" : kind == CG_NMI ? "nmi" : "sub";
+      if (fn >= 0) {
+         sprintf(buffer, "%s_%04X", prefix, fn);
+      } else {
+         sprintf(buffer, "%s_????", prefix);
+      }
+      name = buffer;
+   }
+   write_event(name, kind == CG_CALL ? "call" : "interrupt", 'B');
+   frames[depth].sp          = sp;
+   frames[depth].return_addr = return_addr;
+   depth++;
+}
+
+static void end_frames(int new_depth) {
+   while (depth > new_depth) {
+      depth--;
+      write_event("", "", 'E');
+   }
+}
+
+// Ends the halt event unless still halted, and the block instruction event
+// unless the same block instruction is continuing
+static void end_spans(int halted, int pc, const char *block) {
+   if (halted_open && !halted) {
+      write_event("HALT", "halt", 'E');
+      halted_open = 0;
+   }
+   if (block_pc >= 0 && (!block || pc != block_pc)) {
+      write_event(block_name, "block", 'E');
+      block_pc = -1;
+   }
+}
+
+// Applies the effect of the previous instruction on the call stack
+static void apply_previous() {
+   if (prev_kind == CG_CALL) {
+      begin_frame(prev_kind, prev_target, prev_return_addr, prev_sp);
+   }
+   end_frames(shadow_stack_depth(frames, depth, prev_kind, prev_target, prev_sp));
+   prev_kind = CG_OTHER;
+}
+
+int trace_open(const char *filename, double rate, TraceSymbolLookup symbol_lookup) {
+   stream = fopen(filename, "w");
+   if (!stream) {
+      perror("failed to open trace file");
+      return 1;
+   }
+   samplerate = rate;
+   lookup     = symbol_lookup;
+   fprintf(stream, "{\"traceEvents\":[");
+   return 0;
+}
+
+// Records an instruction at pc (or an interrupt, of kind CG_INT or CG_NMI),
+// which started at the given sample, and left SP at sp. The NOPs executed
+// while halted are passed with halted set, and block is the name of a
+// repeating block instruction (or NULL).
+void trace_instruction(int kind, int target, int return_addr, int sp, int pc, uint64_t sample, int instr_cycles, int halted, const char *block) {
+   now_sample = sample;
+   end_spans(halted, pc, block);
+   apply_previous();
+   if (kind == CG_INT || kind == CG_NMI) {
+      begin_frame(kind, target, return_addr, sp);
+   }
+   if (halted && !halted_open) {
+      write_event("HALT", "halt", 'B');
+      halted_open = 1;
+   } else if (block && block_pc < 0) {
+      block_pc   = pc;
+      block_name = block;
+      write_event(block_name, "block", 'B');
+   }
+   if (kind != CG_INT && kind != CG_NMI) {
+      prev_kind        = kind;
+      prev_target      = target;
+      prev_return_addr = return_addr;
+      prev_sp          = sp;
+   } else {
+      prev_kind        = CG_OTHER;
+      prev_sp          = sp;
+   }
+   tstates += instr_cycles;
+}
+
+// Ends any open events, and finishes the file
+int trace_close() {
+   end_spans(0, -1, NULL);
+   apply_previous();
+   end_frames(0);
+   fprintf(stream, "\n]}\n");
+   if (overflow) {
+      fprintf(stderr, "trace: %d calls beyond a depth of %d were not followed\n", overflow, MAX_TRACE_DEPTH);
+   }
+   if (fclose(stream)) {
+      perror("failed to write trace file");
+      return 1;
+   }
+   return 0;
+}
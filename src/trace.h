@@ -0,0 +1,12 @@
+#ifndef _INCLUDE_TRACE_H
+#define _INCLUDE_TRACE_H
+
+#include <stdint.h>
+
+typedef const char *(*TraceSymbolLookup)(int addr);
+
+int  trace_open(const char *filename, double samplerate, TraceSymbolLookup lookup);
+void trace_instruction(int kind, int target, int return_addr, int sp, int pc, uint64_t sample, int instr_cycles, int halted, const char *block);
+int  trace_close();
+
+#endif
@@ -0,0 +1,153 @@
+//
+// Warning aggregation
+//
+// Each decoder warning is counted by its kind (the message format), the
+// cycle types involved and the PC of the instruction being decoded, with
+// the sample numbers of the first and last occurrence. Only the first few
+// occurrences of each are printed inline if a limit is set, and the
+// summary table lists them all at exit. Decoding can be abandoned once the
+// total reaches a threshold, as the capture is then clearly unusable.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "warnings.h"
+
+typedef struct {
+   const char *format;
+   const char *cycle;
+   const char *next_cycle;
+   int pc;
+   uint64_t count;
+   uint64_t first_sample;
+   uint64_t last_sample;
+} WarningType;
+
+// Warnings are kept in an open addressed hash table, which grows as needed
+static WarningType *warnings = NULL;
+static int warnings_size = 0;
+static int num_warnings = 0;
+
+static uint64_t total = 0;
+
+// The number of each warning printed inline (0 for all of them)
+static int limit = 0;
+
+// The total at which decoding is abandoned (0 for never)
+static uint64_t abort_threshold = 0;
+
+static int warning_hash(const WarningType *w, int size) {
+   uint64_t key = (uintptr_t) w->format ^ ((uintptr_t) w->cycle << 7) ^ ((uintptr_t) w->next_cycle << 13) ^ ((uint64_t) (w->pc + 1) << 40);
+   return (int) ((key * 0x9E3779B97F4A7C15ull) >> 40) & (size - 1);
+}
+
+static int same_warning(const WarningType *a, const WarningType *b) {
+   return a->format == b->format && a->cycle == b->cycle && a->next_cycle == b->next_cycle && a->pc == b->pc;
+}
+
+static WarningType *find_warning(const WarningType *key) {
+   if ((num_warnings + 1) * 4 > warnings_size * 3) {
+      // Grow the table, rehashing the existing warnings
+      int size = warnings_size ? warnings_size * 2 : 256;
+      WarningType *table = calloc(size, sizeof(WarningType));
+      if (!table) {
+         return NULL;
+      }
+      for (int i = 0; i < warnings_size; i++) {
+         if (warnings[i].count) {
+            int j = warning_hash(&warnings[i], size);
+            while (table[j].count) {
+               j = (j + 1) & (size - 1);
+            }
+            table[j] = warnings[i];
+         }
+      }
+      free(warnings);
+      warnings = table;
+      warnings_size = size;
+   }
+   int i = warning_hash(key, warnings_size);
+   while (warnings[i].count && !same_warning(&warnings[i], key)) {
+      i = (i + 1) & (warnings_size - 1);
+   }
+   if (!warnings[i].count) {
+      warnings[i] = *key;
+      warnings[i].first_sample = key->last_sample;
+      num_warnings++;
+   }
+   return &warnings[i];
+}
+
+void warnings_set_limit(int n) {
+   limit = n;
+}
+
+void warnings_set_abort(uint64_t threshold) {
+   abort_threshold = threshold;
+}
+
+// Counts a warning, where format takes the cycle names as arguments.
+// Returns non-zero if it should be printed inline.
+int warnings_add(const char *format, const char *cycle, const char *next_cycle, int pc, uint64_t sample) {
+   WarningType key = { format, cycle, next_cycle, pc, 0, 0, sample };
+   WarningType *w = find_warning(&key);
+   total++;
+   if (!w) {
+      return 1;
+   }
+   w->count++;
+   w->last_sample = sample;
+   return !limit || w->count <= limit;
+}
+
+// Returns non-zero once the abort threshold has been reached
+int warnings_exceeded() {
+   return abort_threshold && total >= abort_threshold;
+}
+
+uint64_t warnings_total() {
+   return total;
+}
+
+static int compare_count(const void *a, const void *b) {
+   const WarningType *wa = a;
+   const WarningType *wb = b;
+   if (wa->count != wb->count) {
+      return wa->count < wb->count ? 1 : -1;
+   }
+   return wa->first_sample < wb->first_sample ? -1 : wa->first_sample > wb->first_sample;
+}
+
+// Writes the warnings, most frequent first
+void warnings_summary(FILE *stream) {
+   WarningType *sorted = malloc((num_warnings ? num_warnings : 1) * sizeof(WarningType));
+   int n = 0;
+   if (!sorted) {
+      return;
+   }
+   for (int i = 0; i < warnings_size; i++) {
+      if (warnings[i].count) {
+         sorted[n++] = warnings[i];
+      }
+   }
+   qsort(sorted, n, sizeof(WarningType), compare_count);
+   fprintf(stream, "WARNINGS: %" PRIu64 " in total, %d distinct\n", total, n);
+   if (n) {
+      fprintf(stream, "%12s %14s %14s %4s  %s\n", "Count", "First sample", "Last sample", "PC", "Warning");
+   }
+   for (int i = 0; i < n; i++) {
+      WarningType *w = &sorted[i];
+      char text[128];
+      char pc[12];
+      snprintf(text, sizeof(text), w->format, w->cycle, w->next_cycle);
+      if (w->pc >= 0) {
+         snprintf(pc, sizeof(pc), "%04X", w->pc);
+      } else {
+         strcpy(pc, "????");
+      }
+      fprintf(stream, "%12" PRIu64 " %14" PRIu64 " %14" PRIu64 " %4s  %s\n",
+              w->count, w->first_sample, w->last_sample, pc, text);
+   }
+   free(sorted);
+}
@@ -0,0 +1,14 @@
+#ifndef _INCLUDE_WARNINGS_H
+#define _INCLUDE_WARNINGS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+void warnings_set_limit(int limit);
+void warnings_set_abort(uint64_t threshold);
+int  warnings_add(const char *format, const char *cycle, const char *next_cycle, int pc, uint64_t sample);
+int  warnings_exceeded();
+uint64_t warnings_total();
+void warnings_summary(FILE *stream);
+
+#endif
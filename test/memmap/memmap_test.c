@@ -0,0 +1,71 @@
+//
+// Memory map test
+//
+// Loads the Spectrum 128 description and initialises the emulator (as
+// decode() does, after the options have been parsed), then checks that the
+// fixed and banked windows alias the physical pages, and that the paging
+// lock is honoured until reset.
+//
+// Run from the top of the tree with test/memmap/run.sh
+
+#include <stdio.h>
+#include <stdint.h>
+#include "em_z80.h"
+#include "memmap.h"
+
+// The instruction state shared with main.c
+int prefix;
+int opcode;
+int arg_dis;
+int arg_imm;
+int arg_read;
+int arg_write;
+int instr_len;
+int failflag;
+
+static int failures = 0;
+
+static void check(const char *what, int addr, int expected) {
+   int actual = memmap_read(addr);
+   if (actual != expected) {
+      printf("FAIL: %s: %04X reads %d, expected %d\n", what, addr, actual, expected);
+      failures++;
+   }
+}
+
+int main(int argc, char *argv[]) {
+   const char *filename = argc > 1 ? argv[1] : "docs/memmap/spectrum128.txt";
+   if (memmap_load(filename)) {
+      return 1;
+   }
+   z80_init(CPU_DEFAULT, 0, 1);
+
+   // RAM bank 5 is fixed at 4000, and is also bank 5 at C000
+   memmap_write(0x4000, 0x55);
+   check("bank 0 at reset", 0xC000, MEM_UNKNOWN);
+   memmap_io_write(0x7FFD, 0x05);
+   check("bank 5 aliases 4000", 0xC000, 0x55);
+
+   // RAM bank 2 is fixed at 8000
+   memmap_io_write(0x7FFD, 0x02);
+   memmap_write(0xC000, 0xAA);
+   check("bank 2 aliases C000", 0x8000, 0xAA);
+
+   // Once locked, the paging no longer changes
+   memmap_io_write(0x7FFD, 0x20);
+   memmap_io_write(0x7FFD, 0x05);
+   check("locked at bank 0", 0xC000, MEM_UNKNOWN);
+
+   // Reset restores the reset mapping, and clears the lock
+   z80_reset();
+   check("bank 0 after reset", 0xC000, MEM_UNKNOWN);
+   memmap_io_write(0x7FFD, 0x05);
+   check("unlocked by reset", 0xC000, 0x55);
+
+   if (failures) {
+      printf("%d failure(s)\n", failures);
+      return 1;
+   }
+   printf("memmap: all tests passed\n");
+   return 0;
+}
@@ -0,0 +1,5 @@
+#!/bin/bash
+#
+# Builds and runs the memory map test, from the top of the tree
+
+gcc -Wall -O3 -D_GNU_SOURCE -Isrc -o test/memmap/memmap_test test/memmap/memmap_test.c src/em_z80.c src/memmap.c -lm && test/memmap/memmap_test